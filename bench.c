@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+#define BENCH_BITMAP		1
+#include "bench.h"
+
+#include <assert.h>
+#include <sched.h>
+
+// Allocator benchmark harness
+//
+// Runs every workload on every allocator many times after a warm-up, pinned to a CPU,
+// and reports min, median and max over the runs of the average time per call in a run.
+// Modes of buddy.c are compile-time, so a build per mode, labelled to tell the results apart:
+// gcc -O2 -DTHREAD_SAFE=2 -pthread buddy.c bitmem.c bench.c -o bench
+// ./bench -n 1000000 -r 50 -l heaps -f csv -o results.csv
+// Lazy against eager merging, for example, is two builds, one with -DLAZY=1, run with -a buddy and labels lazy and eager.
+//
+// Options:
+// -n ops		calls of allocate and free per run (default 100000, anything from 10^3 to 10^8)
+// -s slots	objects alive at most, larger runs repeat their workload (default 16384)
+// -r runs		measured runs (default 31)
+// -w runs		warm-up runs (default 3)
+// -c cpu		CPU to pin to, -1 not to pin (default the CPU the harness starts on)
+// -a names	comma separated allocators to compare (default all)
+// -l label	label of this build, written to every row
+// -f format	csv or json, written to the output file (or to stdout, replacing the table)
+// -o file		output file, CSV unless -f says otherwise
+
+
+#define DEFAULT_OPS			100000
+#define DEFAULT_RUNS		31
+#define DEFAULT_WARMUP		3
+#define DEFAULT_SLOTS		16384
+#define MIN_OPS				1000
+
+
+/// Allocate into a slot and write its address into the memory, so every allocation is touched
+///
+/// Sizes are at least a long int, the address has to fit
+#define assign(slot, size)									\
+	do {													\
+		assert((size) >= sizeof(long int));					\
+		slot = allocator->allocate(size);					\
+		assert(slot != NULL);								\
+		*(long int *)(slot) = (long int)(slot);			\
+	} while (0)
+
+#define clear(slot)											\
+	do {													\
+		assert(*(long int *)(slot) == (long int)(slot));	\
+		allocator->free(slot);								\
+		slot = NULL;										\
+	} while (0)
+
+/// A round of a workload fills count slots and frees everything it allocated
+///
+/// Returns the number of calls made
+typedef size_t (*Workload)(Allocator const *allocator, void **slots, size_t count);
+
+/// Small objects of a regular pattern, freed in the order they came
+static size_t tinyWorkload(Allocator const *allocator, void **slots, size_t count) {
+	static size_t const sizes[3] = {8, 16, 64};
+	for (size_t i = 0; i < count; ++i) assign(slots[i], sizes[i % 3]);
+	for (size_t i = 0; i < count; ++i) clear(slots[i]);
+	return 2 * count;
+}
+
+/// Alternating small and medium objects, freed last in first out
+static size_t zigzagWorkload(Allocator const *allocator, void **slots, size_t count) {
+	for (size_t i = 0; i < count; ++i) assign(slots[i], i % 2 ? 10 : 100);
+	for (size_t i = count; i-- > 0;) clear(slots[i]);
+	return 2 * count;
+}
+
+/// Sizes growing by 32 bytes up to about 3KB and starting over
+static size_t increasingWorkload(Allocator const *allocator, void **slots, size_t count) {
+	for (size_t i = 0; i < count; ++i) assign(slots[i], 20 + (i % 100) * 32);
+	for (size_t i = 0; i < count; ++i) clear(slots[i]);
+	return 2 * count;
+}
+
+/// A hole swept into the middle of the objects and filled with objects of other sizes
+static size_t sweepWorkload(Allocator const *allocator, void **slots, size_t count) {
+	size_t first = count / 5, last = count - count / 5;
+	for (size_t i = 0; i < count; ++i) assign(slots[i], 64);
+	for (size_t i = first; i < last; ++i) clear(slots[i]);
+	for (size_t i = first; i < last; ++i) assign(slots[i], 8 + ((i - first) * 13) % 64);
+	for (size_t i = 0; i < count; ++i) clear(slots[i]);
+	return 2 * count + 2 * (last - first);
+}
+
+/// Mixed sizes, then every even object freed, the even slots refilled while the odd ones are freed, and a cleanup
+static size_t mixedWorkload(Allocator const *allocator, void **slots, size_t count) {
+	count &= ~(size_t)1;
+	for (size_t i = 0; i < count; ++i) {
+		switch (i % 8) {
+			case 0:
+				assign(slots[i], 8 + (i * 31) % 117);
+				break;
+			
+			case 5:
+			case 6:
+				assign(slots[i], 8 + i % 504);
+				break;
+			
+			case 7:
+				assign(slots[i], 2000);
+				break;
+			
+			default:
+				assign(slots[i], 64);
+				break;
+		}
+	}
+	for (size_t i = 0; i < count; i += 2) clear(slots[i]);
+	for (size_t i = 0; i < count; ++i) {
+		if (i % 2 == 0) {
+			assign(slots[i], 12 + i % 512);
+		} else {
+			clear(slots[i]);
+		}
+	}
+	for (size_t i = 0; i < count; i += 2) clear(slots[i]);
+	return 3 * count;
+}
+
+/// Every other object freed, then the rest freed and allocated again one by one at the same size
+///
+/// Each freed object has a free neighbour, so an allocator merging eagerly merges and splits again on every pair
+static size_t reuseWorkload(Allocator const *allocator, void **slots, size_t count) {
+	count &= ~(size_t)1;
+	for (size_t i = 0; i < count; ++i) assign(slots[i], i % 4 < 2 ? 200 : 1000);
+	for (size_t i = 1; i < count; i += 2) clear(slots[i]);
+	for (size_t i = 0; i < count; i += 2) {
+		clear(slots[i]);
+		assign(slots[i], i % 4 < 2 ? 200 : 1000);
+	}
+	for (size_t i = 0; i < count; i += 2) clear(slots[i]);
+	return 3 * count;
+}
+
+static char const * const WORKLOAD_NAMES[] = {"tiny", "zig-zag", "increasing", "sweep", "mixed", "reuse"};
+static Workload const WORKLOADS[] = {tinyWorkload, zigzagWorkload, increasingWorkload, sweepWorkload, mixedWorkload, reuseWorkload};
+
+#define WORKLOAD_COUNT		(sizeof(WORKLOADS) / sizeof(WORKLOADS[0]))
+
+typedef struct Result {
+	char const	*allocator;
+	char const	*workload;
+	size_t		ops;		// calls per run, rounded up to whole rounds
+	double		min;		// nanoseconds per call
+	double		median;
+	double		max;
+} Result;
+
+/// Repeat rounds of a workload until at least ops calls are made
+static size_t runWorkload(Allocator const *allocator, size_t workload, void **slots, size_t count, size_t ops) {
+	size_t calls = 0;
+	while (calls < ops) calls += WORKLOADS[workload](allocator, slots, count);
+	return calls;
+}
+
+/// Run a workload warmup + runs times, samples get the nanoseconds per call of every measured run
+static Result measure(Allocator const *allocator, size_t workload, void **slots, size_t count, size_t ops, int warmup, int runs, double *samples) {
+	struct timespec start_time;
+	size_t calls = 0;
+	
+	for (int run = 0; run < warmup; ++run) runWorkload(allocator, workload, slots, count, ops);
+	for (int run = 0; run < runs; ++run) {
+		get_now(&start_time);
+		calls = runWorkload(allocator, workload, slots, count, ops);
+		samples[run] = get_nanos_since(&start_time) / (double) calls;
+	}
+	qsort(samples, runs, sizeof(double), compareDoubles);
+	
+	Result result = {allocator->name, WORKLOAD_NAMES[workload], calls, samples[0], 0.0, 0.0};
+	result.median = runs % 2 ? samples[runs / 2] : (samples[runs / 2 - 1] + samples[runs / 2]) / 2;
+	result.max = samples[runs - 1];
+	return result;
+}
+
+static void printCsv(FILE *file, char const *label, Result const *results, size_t count, int runs) {
+	fprintf(file, "label,allocator,workload,ops,runs,min_ns,median_ns,max_ns,mops\n");
+	for (size_t i = 0; i < count; ++i) {
+		Result const *r = &results[i];
+		fprintf(file, "%s,%s,%s,%zu,%d,%.3f,%.3f,%.3f,%.3f\n", label, r->allocator, r->workload, r->ops, runs, r->min, r->median, r->max, 1000.0 / r->median);
+	}
+}
+
+static void printJson(FILE *file, char const *label, Result const *results, size_t count, int runs) {
+	fprintf(file, "[\n");
+	for (size_t i = 0; i < count; ++i) {
+		Result const *r = &results[i];
+		fprintf(file, "{\"label\":\"%s\",\"allocator\":\"%s\",\"workload\":\"%s\",\"ops\":%zu,\"runs\":%d,\"min_ns\":%.3f,\"median_ns\":%.3f,\"max_ns\":%.3f,\"mops\":%.3f}%s\n",
+			label, r->allocator, r->workload, r->ops, runs, r->min, r->median, r->max, 1000.0 / r->median, i + 1 < count ? "," : "");
+	}
+	fprintf(file, "]\n");
+}
+
+static void printTable(char const *label, Result const *results, size_t count, size_t ops, size_t live, int warmup, int runs, int cpu) {
+	printf("%zu calls per run on %zu slots, %d runs after %d warm-up runs", ops, live, runs, warmup);
+	if (cpu >= 0) printf(", pinned to CPU %d", cpu);
+	if (*label) printf(", %s", label);
+	printf("\n%-12s || %-10s || %9s || %9s || %9s || %9s\n", "allocator", "workload", "min", "median", "max", "Mops/s");
+	for (size_t i = 0; i < count; ++i) {
+		Result const *r = &results[i];
+		printf("%-12s || %-10s || %7.2fns || %7.2fns || %7.2fns || %9.2f\n", r->allocator, r->workload, r->min, r->median, r->max, 1000.0 / r->median);
+	}
+}
+
+static void usage(char const *program) {
+	fprintf(stderr, "usage: %s [-n ops] [-s slots] [-r runs] [-w warmup] [-c cpu] [-a allocators] [-l label] [-f csv|json] [-o file]\n", program);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	size_t ops = DEFAULT_OPS;
+	size_t live = DEFAULT_SLOTS;
+	int runs = DEFAULT_RUNS;
+	int warmup = DEFAULT_WARMUP;
+	int cpu = sched_getcpu();
+	char const *names = NULL;
+	char const *label = "";
+	char const *format = NULL;
+	char const *output = NULL;
+	
+	int option;
+	while ((option = getopt(argc, argv, "n:s:r:w:c:a:l:f:o:")) != -1) {
+		switch (option) {
+			case 'n': ops = strtoull(optarg, NULL, 0); break;
+			case 's': live = strtoull(optarg, NULL, 0); break;
+			case 'r': runs = atoi(optarg); break;
+			case 'w': warmup = atoi(optarg); break;
+			case 'c': cpu = atoi(optarg); break;
+			case 'a': names = optarg; break;
+			case 'l': label = optarg; break;
+			case 'f': format = optarg; break;
+			case 'o': output = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (ops < MIN_OPS || live < 2 || runs < 1 || warmup < 0) usage(argv[0]);
+	if (format != NULL && strcmp(format, "csv") != 0 && strcmp(format, "json") != 0) usage(argv[0]);
+	if (output != NULL && format == NULL) format = "csv";
+	
+	if (cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+			perror("sched_setaffinity");
+			cpu = -1;
+		}
+	}
+	
+	// Slots and samples are set up (and touched) before anything is measured
+	// A round makes at least two calls per slot, runs smaller than a round take fewer slots
+	if (live > ops / 2) live = ops / 2;
+	void **slots = calloc(live, sizeof(void*));
+	double *samples = calloc(runs, sizeof(double));
+	Result *results = calloc(ALLOCATOR_COUNT * WORKLOAD_COUNT, sizeof(Result));
+	if (slots == NULL || samples == NULL || results == NULL) {
+		fprintf(stderr, "not enough memory for %zu slots\n", live);
+		return 1;
+	}
+	
+	size_t count = 0;
+	for (size_t a = 0; a < ALLOCATOR_COUNT; ++a) {
+		if (!isSelected(names, ALLOCATORS[a].name)) continue;
+		for (size_t w = 0; w < WORKLOAD_COUNT; ++w) {
+			results[count++] = measure(&ALLOCATORS[a], w, slots, live, ops, warmup, runs, samples);
+		}
+	}
+	
+	FILE *file = stdout;
+	if (output != NULL) {
+		file = fopen(output, "w");
+		if (file == NULL) {
+			perror(output);
+			return 1;
+		}
+	}
+	if (format == NULL || output != NULL) printTable(label, results, count, ops, live, warmup, runs, cpu);
+	if (format != NULL && strcmp(format, "csv") == 0) printCsv(file, label, results, count, runs);
+	if (format != NULL && strcmp(format, "json") == 0) printJson(file, label, results, count, runs);
+	if (file != stdout) fclose(file);
+	
+	free(results);
+	free(samples);
+	free(slots);
+	return 0;
+}
@@ -0,0 +1,96 @@
+#include "buddy.h"
+#include "timing.h"
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Helpers shared by the benchmarks: the allocators to compare and reading the memory of the process
+//
+// Define BENCH_BITMAP to 1 before including it to compare the allocator of bitmem.c too, then link bitmem.c,
+// it isn't thread safe, so only single threaded benchmarks do.
+
+
+#ifndef BENCH_BITMAP
+#define BENCH_BITMAP		0
+#endif
+
+#if BENCH_BITMAP
+#include "bitmem.h"
+#endif // BENCH_BITMAP
+
+static inline void *mallocAligned(size_t size, size_t alignment) {
+	void *memory = NULL;
+	return posix_memalign(&memory, alignment < sizeof(void*) ? sizeof(void*) : alignment, size) == 0 ? memory : NULL;
+}
+
+static inline size_t mallocTrim() {
+	malloc_trim(0);
+	return 0;
+}
+
+typedef struct Allocator {
+	char const	*name;
+	void		*(*allocate)(size_t);
+	void		(*free)(void *);
+	void		*(*reallocate)(void *, size_t);		// NULL to allocate, copy and free
+	void		*(*allocateAligned)(size_t, size_t);	// NULL to ignore the alignment
+	size_t		(*trim)();							// NULL if there is nothing to give back, returns bytes released
+} Allocator;
+
+/// Allocators to compare, new ones only need an entry here
+static Allocator const ALLOCATORS[] = {
+	{"default",	malloc,		free,		realloc,	mallocAligned,	mallocTrim},
+	{"buddy",	balloc,		bfree,		brealloc,	balloc_aligned,	btrim},
+#if BENCH_BITMAP
+	{"bitmap",	bm_alloc,	bm_free,	NULL,		NULL,			NULL},
+#endif // BENCH_BITMAP
+};
+
+#define ALLOCATOR_COUNT		(sizeof(ALLOCATORS) / sizeof(ALLOCATORS[0]))
+
+/// Check if name is one of the comma separated names
+static inline int isSelected(char const *names, char const *name) {
+	if (names == NULL) return 1;
+	size_t length = strlen(name);
+	for (char const *at = names; at != NULL; at = strchr(at, ',')) {
+		if (*at == ',') ++at;
+		if (strncmp(at, name, length) == 0 && (at[length] == ',' || at[length] == '\0')) return 1;
+	}
+	return 0;
+}
+
+static inline int compareDoubles(void const *first, void const *second) {
+	double a = *(double const *)first;
+	double b = *(double const *)second;
+	return (a > b) - (a < b);
+}
+
+/// Read a field of /proc/self/status in KB, 0 if there is none
+static inline size_t readStatus(char const *field) {
+	char line[256];
+	size_t value = 0;
+	size_t length = strlen(field);
+	FILE *file = fopen("/proc/self/status", "r");
+	if (file == NULL) return 0;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (strncmp(line, field, length) == 0 && line[length] == ':') {
+			value = strtoull(line + length + 1, NULL, 10);
+			break;
+		}
+	}
+	fclose(file);
+	return value;
+}
+
+/// Reset the peak resident memory of the process to the current one, returns 0 if the kernel can't
+static inline int resetPeak() {
+	int file = open("/proc/self/clear_refs", O_WRONLY);
+	if (file < 0) return 0;
+	int reset = write(file, "5", 1) == 1;
+	close(file);
+	return reset;
+}
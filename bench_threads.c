@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+#include "bench.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+
+// Multi-threaded scaling benchmark
+//
+// Runs every pattern on 1, 2, 4, ... up to the given number of threads, each thread pinned to a CPU of its own,
+// and reports allocations and frees per second and resident memory per thread.
+// Every measurement runs in a process of its own, so the memory one allocator keeps doesn't count for the next.
+// Needs buddy.c built with a thread safe model, for example:
+// gcc -O2 -pthread -DTHREAD_SAFE=2 buddy.c bench_threads.c -o bench_threads
+// ./bench_threads -t 64 -n 1000000 -f csv
+//
+// Options:
+// -t threads	most threads to run (default the CPUs available)
+// -n ops		allocations and frees per thread (default 1000000)
+// -p names	comma separated patterns to run (default all)
+// -a names	comma separated allocators to compare (default all)
+// -f csv		print CSV instead of a table
+
+
+#define DEFAULT_OPS			1000000
+#define MIN_OPS				65536
+
+#define CHURN_SLOTS			1024		// objects every thread keeps while it replaces random ones
+#define RING_SIZE			1024		// has to be a power of 2
+#define LARSON_SLOTS		1024		// objects of an array, which goes to the next thread every round
+#define LARSON_STEPS		4096		// replacements made in every array before it moves on
+#define BURST_SIZE			4096		// objects allocated at once, then freed at once
+
+static size_t const SIZES[] = {16, 48, 100, 400, 24, 1000, 64, 8};
+#define SIZE_COUNT			(sizeof(SIZES) / sizeof(SIZES[0]))
+
+
+/// Single producer single consumer queue of objects
+typedef struct Ring {
+	_Alignas(64) atomic_size_t	head;
+	_Alignas(64) atomic_size_t	tail;
+	void						*slots[RING_SIZE];
+} Ring;
+
+typedef struct Context {
+	Allocator const		*allocator;
+	int					threads;
+	size_t				ops;			// allocations and frees every thread makes, about
+	pthread_barrier_t	start;			// of all threads and the one measuring them
+	pthread_barrier_t	round;			// of the larson pattern
+	Ring				*rings;			// a ring from every thread to the next one
+	void				***arrays;		// arrays of the larson pattern
+} Context;
+
+typedef struct Worker {
+	_Alignas(64) Context	*context;
+	int						index;
+	int						cpu;		// -1 not to pin
+	unsigned				seed;
+	size_t					(*pattern)(struct Worker *);
+	size_t					done;		// allocations and frees made
+} Worker;
+
+static inline unsigned nextRandom(unsigned *seed) {
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+static inline void *allocateObject(Worker *worker) {
+	long int *object = (long int*) worker->context->allocator->allocate(SIZES[nextRandom(&worker->seed) % SIZE_COUNT]);
+	assert(object != NULL);
+	*object = (long int) object;
+	return object;
+}
+
+static inline void freeObject(Worker *worker, void *object) {
+	assert(*(long int*) object == (long int) object);
+	worker->context->allocator->free(object);
+}
+
+/// Every thread replaces random objects of its own
+static size_t churnPattern(Worker *worker) {
+	void *slots[CHURN_SLOTS];
+	size_t replacements = (worker->context->ops - 2 * CHURN_SLOTS) / 2;
+	for (size_t i = 0; i < CHURN_SLOTS; ++i) slots[i] = allocateObject(worker);
+	for (size_t i = 0; i < replacements; ++i) {
+		size_t slot = nextRandom(&worker->seed) % CHURN_SLOTS;
+		freeObject(worker, slots[slot]);
+		slots[slot] = allocateObject(worker);
+	}
+	for (size_t i = 0; i < CHURN_SLOTS; ++i) freeObject(worker, slots[i]);
+	return 2 * CHURN_SLOTS + 2 * replacements;
+}
+
+/// Every thread passes its objects to the next one, which frees them (a single thread frees its own)
+static size_t producerPattern(Worker *worker) {
+	Context *context = worker->context;
+	Ring *out = &context->rings[worker->index];
+	Ring *in = &context->rings[(worker->index + context->threads - 1) % context->threads];
+	size_t objects = context->ops / 2, produced = 0, consumed = 0;
+	
+	while (produced < objects || consumed < objects) {
+		int progress = 0;
+		size_t head = atomic_load_explicit(&out->head, memory_order_relaxed);
+		size_t limit = atomic_load_explicit(&out->tail, memory_order_acquire) + RING_SIZE;
+		for (; produced < objects && head < limit; ++produced, ++head) out->slots[head % RING_SIZE] = allocateObject(worker);
+		if (head != atomic_load_explicit(&out->head, memory_order_relaxed)) {
+			atomic_store_explicit(&out->head, head, memory_order_release);
+			progress = 1;
+		}
+		
+		size_t tail = atomic_load_explicit(&in->tail, memory_order_relaxed);
+		size_t available = atomic_load_explicit(&in->head, memory_order_acquire);
+		for (; tail < available; ++consumed, ++tail) freeObject(worker, in->slots[tail % RING_SIZE]);
+		if (tail != atomic_load_explicit(&in->tail, memory_order_relaxed)) {
+			atomic_store_explicit(&in->tail, tail, memory_order_release);
+			progress = 1;
+		}
+		if (!progress) sched_yield();
+	}
+	return 2 * objects;
+}
+
+/// Every thread replaces random objects of an array, the arrays move on to the next thread every round
+///
+/// Objects end up freed by other threads than the ones that allocated them, like in the larson benchmark
+static size_t larsonPattern(Worker *worker) {
+	Context *context = worker->context;
+	size_t rounds = (context->ops - 2 * LARSON_SLOTS) / (2 * LARSON_STEPS);
+	if (rounds == 0) rounds = 1;
+	
+	void **slots = context->arrays[worker->index];
+	for (size_t i = 0; i < LARSON_SLOTS; ++i) slots[i] = allocateObject(worker);
+	for (size_t round = 0; round < rounds; ++round) {
+		pthread_barrier_wait(&context->round);
+		slots = context->arrays[(worker->index + round) % context->threads];
+		for (size_t i = 0; i < LARSON_STEPS; ++i) {
+			size_t slot = nextRandom(&worker->seed) % LARSON_SLOTS;
+			freeObject(worker, slots[slot]);
+			slots[slot] = allocateObject(worker);
+		}
+	}
+	pthread_barrier_wait(&context->round);
+	for (size_t i = 0; i < LARSON_SLOTS; ++i) freeObject(worker, slots[i]);
+	return 2 * LARSON_SLOTS + 2 * rounds * LARSON_STEPS;
+}
+
+/// Every thread allocates a burst of objects and frees all of them, alternately in and against their order
+static size_t burstPattern(Worker *worker) {
+	void *slots[BURST_SIZE];
+	size_t bursts = worker->context->ops / (2 * BURST_SIZE);
+	for (size_t burst = 0; burst < bursts; ++burst) {
+		for (size_t i = 0; i < BURST_SIZE; ++i) slots[i] = allocateObject(worker);
+		if (burst % 2) {
+			for (size_t i = 0; i < BURST_SIZE; ++i) freeObject(worker, slots[i]);
+		} else {
+			for (size_t i = BURST_SIZE; i-- > 0;) freeObject(worker, slots[i]);
+		}
+	}
+	return 2 * BURST_SIZE * bursts;
+}
+
+static char const * const PATTERN_NAMES[] = {"churn", "producer", "larson", "burst"};
+static size_t (* const PATTERNS[])(Worker *) = {churnPattern, producerPattern, larsonPattern, burstPattern};
+
+#define PATTERN_COUNT		(sizeof(PATTERNS) / sizeof(PATTERNS[0]))
+
+static void *work(void *arg) {
+	Worker *worker = (Worker*) arg;
+	if (worker->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(worker->cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+	pthread_barrier_wait(&worker->context->start);
+	worker->done = worker->pattern(worker);
+	return NULL;
+}
+
+typedef struct Result {
+	double	opsPerSecond;
+	size_t	residentPerThread;		// peak resident bytes the run added, over the threads
+} Result;
+
+/// Run a pattern on given number of threads
+static Result measure(Allocator const *allocator, size_t pattern, int threads, size_t ops, int const *cpus, int cpuCount) {
+	Context context = {allocator, threads, ops, {{0}}, {{0}}, NULL, NULL};
+	Worker *workers = aligned_alloc(64, sizeof(Worker) * threads);
+	pthread_t *handles = calloc(threads, sizeof(pthread_t));
+	context.rings = aligned_alloc(64, sizeof(Ring) * threads);
+	context.arrays = calloc(threads, sizeof(void**));
+	for (int i = 0; i < threads; ++i) {
+		atomic_init(&context.rings[i].head, 0);
+		atomic_init(&context.rings[i].tail, 0);
+		context.arrays[i] = calloc(LARSON_SLOTS, sizeof(void*));
+		workers[i] = (Worker) {&context, i, cpuCount > 0 ? cpus[i % cpuCount] : -1, 2463534242u + i, PATTERNS[pattern], 0};
+	}
+	pthread_barrier_init(&context.start, NULL, threads + 1);
+	pthread_barrier_init(&context.round, NULL, threads);
+	
+	size_t baseline = readStatus("VmRSS");
+	int peakReset = resetPeak();
+	for (int i = 0; i < threads; ++i) pthread_create(&handles[i], NULL, work, &workers[i]);
+	
+	struct timespec start_time;
+	pthread_barrier_wait(&context.start);
+	get_now(&start_time);
+	for (int i = 0; i < threads; ++i) pthread_join(handles[i], NULL);
+	double nanos = get_nanos_since(&start_time);
+	
+	size_t peak = peakReset ? readStatus("VmHWM") : readStatus("VmRSS");
+	size_t done = 0;
+	for (int i = 0; i < threads; ++i) done += workers[i].done;
+	Result result = {done * (double) GIGA / nanos, peak > baseline ? (peak - baseline) * 1024 / threads : 0};
+	
+	pthread_barrier_destroy(&context.round);
+	pthread_barrier_destroy(&context.start);
+	for (int i = 0; i < threads; ++i) free(context.arrays[i]);
+	free(context.arrays);
+	free(context.rings);
+	free(handles);
+	free(workers);
+	return result;
+}
+
+static void usage(char const *program) {
+	fprintf(stderr, "usage: %s [-t threads] [-n ops] [-p patterns] [-a allocators] [-f csv]\n", program);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	cpu_set_t available;
+	int cpus[CPU_SETSIZE];
+	int cpuCount = 0;
+	if (sched_getaffinity(0, sizeof(available), &available) == 0) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &available)) cpus[cpuCount++] = cpu;
+		}
+	}
+	
+	int maxThreads = cpuCount > 0 ? cpuCount : 1;
+	size_t ops = DEFAULT_OPS;
+	char const *patterns = NULL;
+	char const *names = NULL;
+	int csv = 0;
+	
+	int option;
+	while ((option = getopt(argc, argv, "t:n:p:a:f:")) != -1) {
+		switch (option) {
+			case 't': maxThreads = atoi(optarg); break;
+			case 'n': ops = strtoull(optarg, NULL, 0); break;
+			case 'p': patterns = optarg; break;
+			case 'a': names = optarg; break;
+			case 'f': csv = strcmp(optarg, "csv") == 0; if (!csv) usage(argv[0]); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (maxThreads < 1 || ops < MIN_OPS) usage(argv[0]);
+	
+	if (csv) {
+		printf("allocator,pattern,threads,ops_per_second,scaling,resident_per_thread\n");
+	} else {
+		printf("%zu allocations and frees per thread, up to %d threads on %d CPUs\n", ops, maxThreads, cpuCount);
+		printf("%-10s || %-8s || %7s || %12s || %8s || %12s\n", "pattern", "allocator", "threads", "Mops/s", "scaling", "RSS/thread");
+	}
+	fflush(stdout);
+	
+	for (size_t p = 0; p < PATTERN_COUNT; ++p) {
+		if (!isSelected(patterns, PATTERN_NAMES[p])) continue;
+		for (size_t a = 0; a < ALLOCATOR_COUNT; ++a) {
+			if (!isSelected(names, ALLOCATORS[a].name)) continue;
+			double single = 0.0;
+			for (int threads = 1; ; threads = threads * 2 < maxThreads ? threads * 2 : maxThreads) {
+				// A process of its own for every run, the result comes back through a pipe
+				int channel[2];
+				if (pipe(channel) != 0) {
+					perror("pipe");
+					return 1;
+				}
+				pid_t child = fork();
+				if (child == 0) {
+					close(channel[0]);
+					Result result = measure(&ALLOCATORS[a], p, threads, ops, cpus, cpuCount);
+					_exit(write(channel[1], &result, sizeof(result)) == sizeof(result) ? 0 : 1);
+				}
+				// Only the child may hold the writing end, a child that dies without a result ends the read
+				close(channel[1]);
+				Result result = {0.0, 0};
+				if (child < 0 || read(channel[0], &result, sizeof(result)) != sizeof(result)) {
+					fprintf(stderr, "%s %s on %d threads failed\n", PATTERN_NAMES[p], ALLOCATORS[a].name, threads);
+				}
+				if (child > 0) waitpid(child, NULL, 0);
+				close(channel[0]);
+				
+				if (threads == 1) single = result.opsPerSecond;
+				double scaling = single > 0.0 ? result.opsPerSecond / single : 0.0;
+				if (csv) {
+					printf("%s,%s,%d,%.0f,%.3f,%zu\n", ALLOCATORS[a].name, PATTERN_NAMES[p], threads, result.opsPerSecond, scaling, result.residentPerThread);
+				} else {
+					printf("%-10s || %-8s || %7d || %12.2f || %7.2fx || %10zuKB\n", PATTERN_NAMES[p], ALLOCATORS[a].name, threads, result.opsPerSecond / 1000000, scaling, result.residentPerThread / 1024);
+				}
+				fflush(stdout);
+				if (threads == maxThreads) break;
+			}
+		}
+	}
+	return 0;
+}
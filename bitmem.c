@@ -1,131 +1,149 @@
 #include "bitmem.h"
 
 #include <assert.h>
+#include <limits.h>
+#include <stdint.h>
 #include <sys/mman.h>
 #include <stdio.h>
 #include <string.h>
 
-#define MIN					5
-#define LEVELS				8
-#define MAX_LEVEL			LEVELS - 1	// this is how counting works
+#define MIN					5				// every page is split into units of 32 bytes
 #define PAGE				4096
+#define UNITS				(PAGE >> MIN)	// 128 units per page
+#define PAGE_MASK_ADDRESS	(~(long int)(PAGE - 1))
+#define CACHED_PAGES		4				// empty pages kept mapped for reuse
 
-#define check_bounds(x)		assert(x <= MAX_LEVEL)	// redefine this to skip assertion
+#define check_bounds(x)		assert(x <= UNITS)	// redefine this to skip assertion
 
 
 // Optional safety
-#define CLEAN_PAGE_ADDRESS		1
 #define ALLOC_ASSERT			1
 #define PAGE_IN_RANGE_ASSERT	1
 #define ADDRESS_ASSERT			1
 
 typedef unsigned long int bitfield_t;
-typedef unsigned int level_t;
+
+#define WORD_BITS			(sizeof(bitfield_t) * 8)
+#define WORDS				(UNITS / WORD_BITS)
 
 typedef struct BlockHead {
 	bitfield_t	bitfield;
 } BlockHead;
 
 typedef struct PageDescriptor {
-	// We have 128 actual blocks (lowest level)
-	// But we then have a bit for each level to optimize allocation timing
-	// This is free memory wise (the page descriptor is 32 bytes already and needs a BlockHead, so 40 bytes takes the same size
-	bitfield_t				blocks[2];
+	// We have 128 units, a set bit marks a taken unit
+	// The descriptor itself takes the first units of the page it describes
+	bitfield_t				blocks[WORDS];
 	struct PageDescriptor	*next, *prev;
-	void 					*page;
+	int						free;			// number of free units, so full pages are skipped without a search
 } PageDescriptor;
 
+#define DESCRIPTOR_UNITS	((sizeof(PageDescriptor) + (1 << MIN) - 1) >> MIN)
+
 
 static struct {
 	struct PageDescriptor *front, *back;
+	int empty;
 } pages;
 
-// Note: There might be an obvious mathematic interpretation if one reorders some bits,
-// but I didn't find one
-static int const LEVEL_OFFSETS = {
-	0,		// level 0:   0-127
-	128,	// level 1: 128-191
-	192,	// level 2: 192-223
-	244,	// level 3: 224-239
-	240,	// level 4: 240-247
-	248,	// level 5: 248-251
-	252,	// level 6: 252-253
-	254,	// level 7: 254-254
-	255		// Last size, might be used by internal algorithms (ie, upper bound for level 7)
-};
-
-#define BITFIELD_LEVEL				0x0000000000000007
+// A block head holds the number of units of the block and a status flag
+// Blocks with a mapping of their own hold the number of pages of the mapping instead
+#define BITFIELD_COUNT				0x00000000000000FF
+#define BITFIELD_MAPPEDFLAG			0x0000000000000400
 #define BITFIELD_STATUSFLAG			0x0000000000000800
-#define BITFIELD_UNUSED				0x00000000000007F8
-#define BITFIELD_ADDRESS			0xFFFFFFFFFFFFF000
-#define BITFIELD_OTHER				0x0000000000000FFF
+#define BITFIELD_PAGES				0xFFFFFFFFFFFFF000
+#define BITFIELD_PAGES_SHIFT		12
 
 #define set_free(bitfield)			bitfield |= BITFIELD_STATUSFLAG
 #define set_taken(bitfield) 		bitfield &= ~BITFIELD_STATUSFLAG
 
 #define is_free(bitfield)			(bitfield & BITFIELD_STATUSFLAG)
+#define is_mapped(bitfield)			(bitfield & BITFIELD_MAPPEDFLAG)
 
-#define set_level(bitfield, level)	bitfield = (bitfield & ~BITFIELD_LEVEL) | level
-#define get_level(bitfield)			(bitfield & BITFIELD_LEVEL)
-
-static inline void set_page(bitfield_t *bitfield, PageDescriptor *page) {
-#if CLEAN_PAGE_ADDRESS
-	*bitfield = (*bitfield & ~BITFIELD_ADDRESS) | ((bitfield_t) page & BITFIELD_ADDRESS);
-#else // CLEAN_PAGE_ADDRESS
-	*bitfield = (*bitfield & ~BITFIELD_ADDRESS) | (bitfield_t) page;
-#endif // CLEAN_PAGE_ADDRESS
-}
-
-static inline PageDescriptor *get_page(bitfield_t bitfield) {
-	return (PageDescriptor*)(bitfield & BITFIELD_ADDRESS);
-}
-
-static inline void set_other(bitfield_t *bitfield, long int value) {
-	*bitfield = (*bitfield & ~BITFIELD_OTHER) | (value & BITFIELD_OTHER);
-}
+#define set_count(bitfield, count)	bitfield = (bitfield & ~BITFIELD_COUNT) | (count)
+#define get_count(bitfield)			(bitfield & BITFIELD_COUNT)
 
-static inline long int get_other(bitfield_t bitfield) {
-	return (bitfield & BITFIELD_OTHER);
-}
+#define get_pages(bitfield)			((bitfield & BITFIELD_PAGES) >> BITFIELD_PAGES_SHIFT)
 
 static inline void push_page(PageDescriptor *page) {
-	if (pages.back != NULL) {
-		pages.back->next = page;
-		page->prev = pages.back;
-		pages.back = page;
+	page->prev = NULL;
+	page->next = pages.front;
+	if (pages.front != NULL) {
+		pages.front->prev = page;
 	} else {
-		pages.back = pages.front = page;
+		pages.back = page;
 	}
+	pages.front = page;
 }
 
-static inline PageDescriptor *pop_page(PageDescriptor *page) {
+static inline void pop_page(PageDescriptor *page) {
 	if (page->prev != NULL) page->prev->next = page->next;
 	if (page->next != NULL) page->next->prev = page->prev;
 	if (pages.front == page) pages.front = page->next;
 	if (pages.back == page) pages.back = page->prev;
+	page->next = page->prev = NULL;
 }
 
-static inline int get_bit(bitfield_t *bitfields, int bit) {
-	int offset = bit / (sizeof(bitfield_t) * 8);
-	bitfield_t mask = 1 << bit % (sizeof(bitfield_t) * 8);
-	return bitfields[offset] & mask == mask;
+/// Set or clear given number of bits starting at given bit
+///
+/// Works a word at a time, so a run never costs more than a couple of masks
+static inline void set_bits(bitfield_t *bitfields, int bit, int count, int value) {
+	while (count > 0) {
+		int offset = bit / WORD_BITS;
+		int shift = bit % WORD_BITS;
+		int taken = count < (int)(WORD_BITS - shift) ? count : (int)(WORD_BITS - shift);
+		bitfield_t mask = (taken == WORD_BITS ? ~0x0UL : ((0x1UL << taken) - 1)) << shift;
+		if (value) {
+			bitfields[offset] |= mask;
+		} else {
+			bitfields[offset] &= ~mask;
+		}
+		bit += taken;
+		count -= taken;
+	}
 }
 
-static inline void set_bit(bitfield_t *bitfields, int bit, int value) {
-	int offset = bit / (sizeof(bitfield_t) * 8);
-	bitfield_t mask = 1 << bit % (sizeof(bitfield_t) * 8);
-	bitfield_t val = value << bit % (sizeof(bitfield_t) * 8);
-	bitfields[offset] = (bitfields[offset] & ~mask) | value;
+/// Shift a multi word bitmap right by given number of bits (less than a word)
+static inline void shift_right(bitfield_t *bitfields, int shift) {
+	for (unsigned int i = 0; i < WORDS - 1; ++i) {
+		bitfields[i] = (bitfields[i] >> shift) | (bitfields[i + 1] << (WORD_BITS - shift));
+	}
+	bitfields[WORDS - 1] >>= shift;
 }
 
-
-static void init() __attribute__((constructor));
+/// Find the first run of given number of free units in a bitmap
+///
+/// A bit of the open (free) map survives s rounds of free &= free >> k (doubling k)
+/// only if the following count units are free too.
+/// So a run is found with log(count) shifts of whole words and a single ctz.
+/// Returns the first unit of the run or -1 if there is no such run
+static inline int find_run(bitfield_t const *blocks, int count) {
+	bitfield_t open[WORDS];
+	bitfield_t shifted[WORDS];
+	for (unsigned int i = 0; i < WORDS; ++i) open[i] = ~blocks[i];
+	
+	int length = 1;
+	while (length < count) {
+		int shift = length < count - length ? length : count - length;
+		memcpy(shifted, open, sizeof(open));
+		shift_right(shifted, shift);
+		bitfield_t any = 0;
+		for (unsigned int i = 0; i < WORDS; ++i) any |= (open[i] &= shifted[i]);
+		if (any == 0) return -1;
+		length += shift;
+	}
+	
+	for (unsigned int i = 0; i < WORDS; ++i) {
+		if (open[i] != 0) return i * WORD_BITS + __builtin_ctzl(open[i]);
+	}
+	return -1;
+}
 
 
 /// Allocate a new page from OS.
 ///
-/// Maps a new Page and initializes its PageHead
-void *map_new_page() {
+/// Maps a new Page and initializes its PageDescriptor
+PageDescriptor *map_new_page() {
 	void *new = mmap(
 		NULL,							// hint for OS memory location, we let it decide
 		PAGE,							// size of the newly mapped memory
@@ -134,100 +152,102 @@ void *map_new_page() {
 										// MAP_ANONYMOUS flags the memory to not be backed by any files
 		-1,								// sometimes required to be -1 with MAP_ANONYMOUS, but for the most part ignored
 		0);								// offset should be 0 with ANONYMOUS flag
-
-	if (new == MAP_FAILED) return NULL;	// this should throw an exception in any reasonable language, but in C malloc is noexcep...
-	assert(((long int)new & 0xfff) == 0);	// mmap with MAP_ANONYMOUS flag should be preinitialized to 0
 	
+	if (new == MAP_FAILED) return NULL;	// this should throw an exception in any reasonable language, but in C malloc is noexcep...
+
 #if ADDRESS_ASSERT
 	assert(new == (void *)((long int) new & PAGE_MASK_ADDRESS));
 #endif // ADDRESS_ASSERT
-	
-	return new;
-}
 
-void init() {
-	void *first = map_new_page();
-	
-	PageDescriptor *page = (PageDescriptor*)first;
-	pages.front = pages.back = page;
-	
-	page->page = first;
+	// mmap with MAP_ANONYMOUS flag is preinitialized to 0, so only the descriptor units need to be marked
+	PageDescriptor *page = (PageDescriptor*)new;
+	set_bits(page->blocks, 0, DESCRIPTOR_UNITS, 1);
+	page->free = UNITS - DESCRIPTOR_UNITS;
 	
+	return page;
 }
 
-/// Tries to find a block of given level in given page
+/// Tries to find a block of given number of units in given page
 ///
-/// Returns initialized BlockHead of correct level of NULL if there isn't enough free space in page
-BlockHead *page_take(PageHead *page, level_t level) {
-	// Still uses buddy algorithm to optimise sarch time
-	bitfield_t bits = 1 << level;
-	bitfield_t pos = 0;
-	for (bitfield_t bit = 0; bit < 128; ++bit) {
-		if (!get_bit(page->blocks, bit)) {
-			pos = bit + 1;
-		} else if (bit - pos == bits) {
-			
-		}
-	}
+/// Returns initialized BlockHead of correct size or NULL if there isn't enough free space in page
+BlockHead *page_take(PageDescriptor *page, int count) {
+	check_bounds(count);
+	if (page->free < count) return NULL;
+	
+	int unit = find_run(page->blocks, count);
+	if (unit < 0) return NULL;
 	
-	return NULL;
+	if (page->free == UNITS - DESCRIPTOR_UNITS) pages.empty--;
+	set_bits(page->blocks, unit, count, 1);
+	page->free -= count;
+	
+	BlockHead *block = (BlockHead*)((char*)page + (unit << MIN));
+	block->bitfield = 0;
+	set_count(block->bitfield, count);
+	set_taken(block->bitfield);
+	return block;
 }
 
-/// Find a new BlockHead of given level
+/// Find a new BlockHead of given number of units
 ///
 /// Internally will iterate over all allocated pages
 /// Will allocate a new page if none have a required amount of memory
-BlockHead *take(level_t level) {
-	if (first_page == NULL)	first_page = page_new();
-	
-	PageHead *page = first_page;
-	
-	while (get_page(page->next) != NULL) {
-		BlockHead *block = page_take(page, level);
-		
+BlockHead *take(int count) {
+	for (PageDescriptor *page = pages.front; page != NULL; page = page->next) {
+		BlockHead *block = page_take(page, count);
 		if (block != NULL) return block;
-		
-		page = get_page(page->next);
 	}
 	
-	// Minor problem
-	// find(page) for last page isn't called
-	{
-		BlockHead *block = page_take(page, level);
-		if (block != NULL) return block;
-	}
+	// None of the pages turned out to have space for a given number of units
+	PageDescriptor *page = map_new_page();
+	if (page == NULL) return NULL;
+	push_page(page);
+	pages.empty++;
 	
-	// None of the pages turned out to have space for a given level
-	PageHead *npage = page_new();
+	return page_take(page, count);
+}
+
+/// Map a run of pages for a block that doesn't fit into a page
+BlockHead *take_mapped(size_t size) {
+	size_t total = size + sizeof(BlockHead);
+	if (total < size) return NULL;	// overflow
+	size_t count = (total + PAGE - 1) / PAGE;
 	
-	set_page(&page->next, npage);
-	set_page(&npage->prev, page);
+	BlockHead *block = (BlockHead*) mmap(NULL, count * PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (block == MAP_FAILED) return NULL;
 	
-	return page_take(npage, level);
+	block->bitfield = (count << BITFIELD_PAGES_SHIFT) | BITFIELD_MAPPEDFLAG;
+	return block;
 }
 
 void free_block(BlockHead *block) {
-	PageHead *page = (PageHead *) ((long int)block & PAGE_MASK_ADDRESS);
+	if (is_mapped(block->bitfield)) {
+		munmap(block, get_pages(block->bitfield) * PAGE);
+		return;
+	}
 	
-	level_t level = get_level(block->bitfield);
-	unsigned char mask = ~(~0x1 << level);
+	PageDescriptor *page = (PageDescriptor *) ((long int)block & PAGE_MASK_ADDRESS);
 	
-	long int offset = ((long int)block - (long int)page) / sizeof(BlockHead);
+	int count = get_count(block->bitfield);
+	long int unit = ((long int)block - (long int)page) >> MIN;
 
 #if PAGE_IN_RANGE_ASSERT
-	assert(offset <= 128);
+	assert(unit >= (long int)DESCRIPTOR_UNITS && unit + count <= UNITS);
 #endif // PAGE_IN_RANGE_ASSERT
 
-	unsigned char this = mask << (offset % 8);
-	unsigned char that = ~this;
-	
-	int free_bits = get_other(page->next);
-	free_bits += (0x1 << level);
-	page->blocks[offset / 8] |= this;
-	page->blocks[offset / 8 + 1] |= that;
+	set_free(block->bitfield);
+	set_bits(page->blocks, unit, count, 0);
+	page->free += count;
 	
-	// TODO: return page logic here
-	set_other(&page->next, free_bits);
+	// An empty page is given back, unless there are only a few of them
+	if (page->free == UNITS - DESCRIPTOR_UNITS) {
+		if (pages.empty == CACHED_PAGES) {
+			pop_page(page);
+			munmap(page, PAGE);
+		} else {
+			pages.empty++;
+		}
+	}
 }
 
 void *hide_head(BlockHead *block) {
@@ -238,28 +258,30 @@ struct BlockHead *unhide_head(void *memory) {
 	return ((BlockHead*)memory - 1);
 }
 
-/// Find the level of the necessary block for a given requested memory amount
+/// Find the number of units necessary for a given requested memory amount
 ///
-/// Find find the smallest block size that fits both the requested size of the data as well as the block head for that data
-int block_count(size_t requestedSize) {
-	return (requestedSize + sizeof(BlockHead)) / 32;
+/// Find the smallest number of units that fits both the requested size of the data as well as the block head for that data
+size_t block_count(size_t requestedSize) {
+	size_t total = requestedSize + sizeof(BlockHead);
+	if (total < requestedSize) return SIZE_MAX;	// overflow
+	return (total + (1 << MIN) - 1) >> MIN;
 }
 
 /// Allocate size bytes of memory
 void *bm_alloc(size_t size) {
 	if (size == 0) return NULL;
 	
-	int blocks = block_count(size);
-	
-	assert(blocks < 128);
+	size_t count = block_count(size);
 	
-	BlockHead *block = take(index);
+	// Anything that doesn't fit next to the page descriptor gets its own mapping
+	BlockHead *block = count <= UNITS - DESCRIPTOR_UNITS ? take(count) : take_mapped(size);
+	if (block == NULL) return NULL;
 
 #if ALLOC_ASSERT
 	assert(!is_free(block->bitfield));
-	assert(get_level(block->bitfield) == index);
+	assert(is_mapped(block->bitfield) || get_count(block->bitfield) == count);
 #endif // ALLOC_ASSERT
-	
+
 	return hide_head(block);
 }
 
@@ -0,0 +1,218 @@
+#include "buddy.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Replacement of the malloc family built on balloc and bfree
+//
+// Build as a shared library with a thread safe model and preload it into an unmodified binary:
+// gcc -O2 -shared -fPIC -fvisibility=hidden -pthread -ftls-model=initial-exec -DTHREAD_SAFE=2 buddy.c bmalloc.c -o libbmalloc.so
+// LD_PRELOAD=./libbmalloc.so <command>
+//
+// Hidden visibility keeps the internals of buddy.c from interposing symbols of the same name in the binary
+//
+// Built with -DTRACE=1 (and btrace.c), calls of the program are recorded into the file named by BTRACE:
+// gcc -O2 -shared -fPIC -fvisibility=hidden -pthread -ftls-model=initial-exec -DTHREAD_SAFE=2 -DTRACE=1 buddy.c btrace.c bmalloc.c -o libbtrace.so
+// BTRACE=trace.bin LD_PRELOAD=./libbtrace.so <command>
+
+
+#define BOOTSTRAP_SIZE		(64 * 1024)		// memory for allocations made while the allocator sets itself up
+
+#define EXPORT				__attribute__((visibility("default")))
+
+#ifndef TRACE
+#define TRACE				0
+#endif
+
+#if TRACE
+#include "btrace.h"
+#endif // TRACE
+
+
+/// Allocations made while a thread is inside balloc come from a static arena
+///
+/// Setting up a thread (its heap, its thread specific key) may call back into malloc,
+/// so does the dynamic linker before any of the program runs.
+/// Every arena allocation is preceded by its size, arena memory is never reused.
+static struct {
+	_Alignas(16) char	memory[BOOTSTRAP_SIZE];
+	atomic_size_t		used;
+} bootstrap;
+
+static __thread int entered = 0;
+
+#if TRACE
+static int tracing = 0;		// set before main, so before any other thread runs
+
+__attribute__((constructor)) static void startTrace() {
+	char const *path = getenv("BTRACE");
+	if (path != NULL && btrace_start(path) == 0) tracing = 1;
+}
+
+__attribute__((destructor)) static void stopTrace() {
+	if (tracing) btrace_stop();
+}
+
+/// Record a call of the program, allocations of the allocator itself come from the arena and are left out
+///
+/// Frees are recorded before the memory goes back, so no other thread can get its address first
+/// Only a realloc racing with an allocation of its old address can mix up their objects
+#define trace(op, memory, old, size, alignment)	\
+	do {										\
+		if (tracing && !inBootstrap(memory)) btrace_record(op, memory, old, size, alignment);	\
+	} while (0)
+#else
+#define trace(op, memory, old, size, alignment)	do {} while (0)
+#endif // TRACE
+
+static inline int inBootstrap(void *memory) {
+	return (char*)memory >= bootstrap.memory && (char*)memory < bootstrap.memory + BOOTSTRAP_SIZE;
+}
+
+static void *bootstrapAlloc(size_t size) {
+	size_t total = (size + 16 + 15) & ~(size_t)15;
+	if (total < size) return NULL;
+	size_t offset = atomic_fetch_add_explicit(&bootstrap.used, total, memory_order_relaxed);
+	if (offset + total > BOOTSTRAP_SIZE) return NULL;
+	
+	char *memory = bootstrap.memory + offset;
+	*(size_t*)memory = size;
+	return memory + 16;
+}
+
+static inline size_t bootstrapSize(void *memory) {
+	return *(size_t*)((char*)memory - 16);
+}
+
+/// Allocate through balloc, unless this thread is already inside of it
+static inline void *allocate(size_t size) {
+	if (entered) return bootstrapAlloc(size);
+	entered = 1;
+	void *memory = balloc(size);
+	entered = 0;
+	return memory;
+}
+
+/// Free through bfree, a free from inside of balloc leaves the thread inside of it
+static inline void deallocate(void *memory) {
+	int outer = entered;
+	entered = 1;
+	bfree(memory);
+	entered = outer;
+}
+
+/// Allocate size bytes aligned to a power of 2
+static void *allocateAligned(size_t alignment, size_t size) {
+	if (entered) return alignment <= 16 ? bootstrapAlloc(size) : NULL;	// the arena is aligned to 16 bytes
+	entered = 1;
+	void *memory = balloc_aligned(size ? size : 1, alignment);
+	entered = 0;
+	return memory;
+}
+
+
+EXPORT void *malloc(size_t size) {
+	// Every malloc(0) has to return a unique address
+	void *memory = allocate(size ? size : 1);
+	if (memory == NULL) errno = ENOMEM;
+	trace(BTRACE_ALLOC, memory, NULL, size, 0);
+	return memory;
+}
+
+EXPORT void free(void *memory) {
+	if (memory == NULL || inBootstrap(memory)) return;
+	trace(BTRACE_FREE, memory, NULL, 0, 0);
+	deallocate(memory);
+}
+
+EXPORT void *calloc(size_t count, size_t size) {
+	size_t total;
+	if (__builtin_mul_overflow(count, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	// Not through malloc, the compiler would turn malloc followed by memset back into a call to calloc
+	void *memory = allocate(total ? total : 1);
+	if (memory == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	// Requests larger than a superblock are freshly mapped, clearing them would only commit their pages
+	if (total <= BSUPERBLOCK || inBootstrap(memory)) memset(memory, 0, total);
+	trace(BTRACE_CALLOC, memory, NULL, total, 0);
+	return memory;
+}
+
+EXPORT size_t malloc_usable_size(void *memory) {
+	if (memory == NULL) return 0;
+	if (inBootstrap(memory)) return bootstrapSize(memory);
+	return bsize(memory);
+}
+
+EXPORT void *realloc(void *memory, size_t size) {
+	if (memory == NULL) return malloc(size);
+	if (size == 0) {
+		free(memory);
+		return NULL;
+	}
+	
+	// Arena memory isn't a block, so brealloc can't resize it
+	if (inBootstrap(memory)) {
+		size_t usable = bootstrapSize(memory);
+		void *new = malloc(size);
+		if (new == NULL) return NULL;
+		memcpy(new, memory, usable < size ? usable : size);
+		free(memory);
+		return new;
+	}
+	
+	entered = 1;
+	void *new = brealloc(memory, size);
+	entered = 0;
+	if (new == NULL) errno = ENOMEM;
+	trace(BTRACE_REALLOC, new, memory, size, 0);
+	return new;
+}
+
+EXPORT int posix_memalign(void **result, size_t alignment, size_t size) {
+	if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) return EINVAL;
+	void *memory = allocateAligned(alignment, size);
+	if (memory == NULL) return ENOMEM;
+	trace(BTRACE_ALIGNED, memory, NULL, size, alignment);
+	*result = memory;
+	return 0;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	void *memory = allocateAligned(alignment, size);
+	if (memory == NULL) errno = ENOMEM;
+	trace(BTRACE_ALIGNED, memory, NULL, size, alignment);
+	return memory;
+}
+
+EXPORT void *memalign(size_t alignment, size_t size) {
+	return aligned_alloc(alignment, size);
+}
+
+EXPORT void *valloc(size_t size) {
+	void *memory = allocateAligned(BPAGE, size);
+	if (memory == NULL) errno = ENOMEM;
+	trace(BTRACE_ALIGNED, memory, NULL, size, BPAGE);
+	return memory;
+}
+
+/// valloc of the size rounded up to whole pages
+EXPORT void *pvalloc(size_t size) {
+	size_t rounded = (size + BPAGE - 1) & ~(size_t)(BPAGE - 1);
+	if (rounded < size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return valloc(rounded ? rounded : BPAGE);
+}
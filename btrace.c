@@ -0,0 +1,192 @@
+#include "btrace.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// Recorder of allocation traces
+//
+// Meant to run inside of an interposer (bmalloc.c built with -DTRACE=1), so it never calls malloc:
+// records are buffered in static memory and the map of live addresses to object ids is mapped directly.
+// A single lock orders the records of all threads, which is what the replayer runs them in.
+
+
+#define MAP_INITIAL			(1 << 16)	// slots of the address map, it doubles at half load
+
+
+static struct {
+	pthread_mutex_t	lock;
+	int				file;			// -1 while not recording
+	uint64_t		start;
+	uint64_t		records;
+	uint32_t		objects;
+	BTraceRecord	buffer[BTRACE_BUFFER];
+	size_t			buffered;
+	uintptr_t		*addresses;		// open addressing with linear probing, 0 is an empty slot
+	uint32_t		*ids;
+	size_t			capacity;
+	size_t			live;
+} tracer = {.lock = PTHREAD_MUTEX_INITIALIZER, .file = -1};
+
+static atomic_uint threads;
+static __thread unsigned thread = 0;	// number of the calling thread, 0 until its first record
+
+static inline uint64_t now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static inline size_t slotOf(uintptr_t address, size_t capacity) {
+	// Addresses are aligned, so the low bits carry nothing, a multiplicative hash spreads the rest
+	return (size_t)((address >> 4) * 0x9E3779B97F4A7C15ULL) & (capacity - 1);
+}
+
+static int mapTable(size_t capacity) {
+	size_t bytes = capacity * (sizeof(uintptr_t) + sizeof(uint32_t));
+	void *memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) return -1;
+	
+	uintptr_t *oldAddresses = tracer.addresses;
+	uint32_t *oldIds = tracer.ids;
+	size_t oldCapacity = tracer.capacity;
+	tracer.addresses = memory;
+	tracer.ids = (uint32_t*)(tracer.addresses + capacity);
+	tracer.capacity = capacity;
+	
+	for (size_t i = 0; i < oldCapacity; ++i) {
+		if (oldAddresses[i] == 0) continue;
+		size_t slot = slotOf(oldAddresses[i], capacity);
+		while (tracer.addresses[slot] != 0) slot = (slot + 1) & (capacity - 1);
+		tracer.addresses[slot] = oldAddresses[i];
+		tracer.ids[slot] = oldIds[i];
+	}
+	if (oldAddresses != NULL) munmap(oldAddresses, oldCapacity * (sizeof(uintptr_t) + sizeof(uint32_t)));
+	return 0;
+}
+
+static void insertObject(void *memory, uint32_t id) {
+	if (2 * (tracer.live + 1) > tracer.capacity && mapTable(2 * tracer.capacity) != 0) return;
+	uintptr_t address = (uintptr_t) memory;
+	size_t slot = slotOf(address, tracer.capacity);
+	while (tracer.addresses[slot] != 0) slot = (slot + 1) & (tracer.capacity - 1);
+	tracer.addresses[slot] = address;
+	tracer.ids[slot] = id;
+	++tracer.live;
+}
+
+/// Remove an address from the map and return its object id, UINT32_MAX if it is not there
+static uint32_t removeObject(void *memory) {
+	uintptr_t address = (uintptr_t) memory;
+	size_t mask = tracer.capacity - 1;
+	size_t slot = slotOf(address, tracer.capacity);
+	while (tracer.addresses[slot] != address) {
+		if (tracer.addresses[slot] == 0) return UINT32_MAX;
+		slot = (slot + 1) & mask;
+	}
+	uint32_t id = tracer.ids[slot];
+	--tracer.live;
+	
+	// Shift the rest of the cluster back, so no probe runs into the hole
+	size_t hole = slot;
+	for (size_t next = (slot + 1) & mask; tracer.addresses[next] != 0; next = (next + 1) & mask) {
+		size_t home = slotOf(tracer.addresses[next], tracer.capacity);
+		// Entries whose home lies cyclically in (hole, next] stay where they are
+		if (((next - home) & mask) < ((next - hole) & mask)) continue;
+		tracer.addresses[hole] = tracer.addresses[next];
+		tracer.ids[hole] = tracer.ids[next];
+		hole = next;
+	}
+	tracer.addresses[hole] = 0;
+	return id;
+}
+
+static void flush() {
+	size_t bytes = tracer.buffered * sizeof(BTraceRecord);
+	char const *data = (char const*) tracer.buffer;
+	while (bytes > 0) {
+		ssize_t written = write(tracer.file, data, bytes);
+		if (written <= 0) break;
+		data += written;
+		bytes -= written;
+	}
+	tracer.buffered = 0;
+}
+
+int btrace_start(char const *path) {
+	int file = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (file < 0) return -1;
+	
+	pthread_mutex_lock(&tracer.lock);
+	if (tracer.capacity == 0 && mapTable(MAP_INITIAL) != 0) {
+		pthread_mutex_unlock(&tracer.lock);
+		close(file);
+		return -1;
+	}
+	// The header is completed once the trace stops
+	BTraceHeader header = {BTRACE_MAGIC, sizeof(BTraceRecord), 0, 0, 0};
+	if (write(file, &header, sizeof(header)) != sizeof(header)) {
+		pthread_mutex_unlock(&tracer.lock);
+		close(file);
+		return -1;
+	}
+	tracer.file = file;
+	tracer.start = now();
+	pthread_mutex_unlock(&tracer.lock);
+	return 0;
+}
+
+void btrace_record(enum BTraceOp op, void *memory, void *old, size_t size, size_t alignment) {
+	if (memory == NULL) return;
+	if (thread == 0) thread = atomic_fetch_add_explicit(&threads, 1, memory_order_relaxed) + 1;
+	
+	pthread_mutex_lock(&tracer.lock);
+	if (tracer.file < 0) {
+		pthread_mutex_unlock(&tracer.lock);
+		return;
+	}
+	uint32_t id;
+	if (op == BTRACE_FREE) {
+		id = removeObject(memory);
+		if (id == UINT32_MAX) {
+			pthread_mutex_unlock(&tracer.lock);
+			return;
+		}
+		size = 0;
+	} else {
+		id = op == BTRACE_REALLOC ? removeObject(old) : UINT32_MAX;
+		// Memory allocated before the trace started is new to the trace
+		if (id == UINT32_MAX) {
+			id = tracer.objects++;
+			if (op == BTRACE_REALLOC) op = BTRACE_ALLOC;
+		}
+		insertObject(memory, id);
+	}
+	
+	BTraceRecord *record = &tracer.buffer[tracer.buffered++];
+	record->time = now() - tracer.start;
+	record->size = size;
+	record->object = id;
+	record->thread = (uint16_t) thread;
+	record->op = (uint8_t) op;
+	record->alignment = op == BTRACE_ALIGNED ? (uint8_t) __builtin_ctzl(alignment) : 0;
+	++tracer.records;
+	if (tracer.buffered == BTRACE_BUFFER) flush();
+	pthread_mutex_unlock(&tracer.lock);
+}
+
+void btrace_stop() {
+	pthread_mutex_lock(&tracer.lock);
+	if (tracer.file >= 0) {
+		flush();
+		BTraceHeader header = {BTRACE_MAGIC, sizeof(BTraceRecord), atomic_load(&threads), tracer.records, tracer.objects};
+		pwrite(tracer.file, &header, sizeof(header), 0);
+		close(tracer.file);
+		tracer.file = -1;
+	}
+	pthread_mutex_unlock(&tracer.lock);
+}
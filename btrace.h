@@ -0,0 +1,57 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BTRACE_MAGIC		0x31454341525442ULL	// "BTRACE1" in a little endian word
+#define BTRACE_BUFFER		4096				// records written at once
+
+/// Operations of the malloc family, as recorded
+enum BTraceOp {
+	BTRACE_ALLOC,		// malloc
+	BTRACE_CALLOC,		// calloc, size is the total
+	BTRACE_ALIGNED,		// aligned_alloc, posix_memalign and memalign
+	BTRACE_REALLOC,		// the object keeps its id, size is the new size
+	BTRACE_FREE,		// size is 0
+};
+
+/// Start of a trace file, the records follow
+typedef struct BTraceHeader {
+	uint64_t	magic;
+	uint32_t	recordSize;		// sizeof(BTraceRecord), to catch traces of another layout
+	uint32_t	threads;		// threads seen, filled in when the trace is closed
+	uint64_t	records;		// records in the file, 0 if the traced process never closed it
+	uint64_t	objects;		// object ids handed out, ids go from 0 up and are never reused
+} BTraceHeader;
+
+/// A single call, 24 bytes
+typedef struct BTraceRecord {
+	uint64_t	time;			// nanoseconds since the trace started
+	uint64_t	size;
+	uint32_t	object;
+	uint16_t	thread;			// threads are numbered in the order of their first call
+	uint8_t		op;
+	uint8_t		alignment;		// log2 of the alignment of BTRACE_ALIGNED, 0 otherwise
+} BTraceRecord;
+
+/// Start recording into the file at given path
+///
+/// Allocates nothing through malloc, so it is safe to call from inside of an interposer
+/// Returns 0 on success, -1 if the file can't be created
+int btrace_start(char const *path);
+
+/// Record a call that returned memory (or freed it)
+///
+/// For BTRACE_REALLOC old is the memory given to realloc, ignored otherwise
+/// Memory the recorder hasn't seen allocated is skipped on free and recorded as new on realloc
+/// Thread safe, calls are ordered by a lock
+void btrace_record(enum BTraceOp op, void *memory, void *old, size_t size, size_t alignment);
+
+/// Flush the records and complete the header
+void btrace_stop();
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,22 +1,186 @@
+#define _GNU_SOURCE		// mremap
+
 #include "buddy.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <sys/mman.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+/// Threading models, build with -DTHREAD_SAFE=<model> (and -pthread) to use balloc from multiple threads
+#define MAGAZINES			1	// a shared core behind a lock with per-thread magazines in front of it
+#define THREAD_HEAPS		2	// a private heap per thread, frees from other threads are queued to the owner
+
+#ifndef THREAD_SAFE
+#define THREAD_SAFE			0	// single threaded
+#endif
+
+#ifndef HEADERLESS
+#define HEADERLESS			0	// build with -DHEADERLESS=1 to keep the level and status of blocks out of band
+#endif
+
+#ifndef SLABS
+#define SLABS				(THREAD_SAFE != MAGAZINES)	// magazines already keep tiny blocks per thread
+#endif
+
+#ifndef LATENCY
+#define LATENCY				0	// build with -DLATENCY=1 to time every balloc and bfree by the path it took
+#endif
+
+#ifndef LAZY
+#define LAZY				0	// build with -DLAZY=1 to merge freed blocks only once memory runs short
+#endif
+
+#ifndef COMPACT
+#define COMPACT				0	// build with -DCOMPACT=1 to place blocks into the fullest pages, so sparse ones drain
+#endif
+
+#ifndef HUGE_PAGES
+#define HUGE_PAGES			0	// build with -DHUGE_PAGES=1 to map superblocks in pairs advised for transparent huge pages
+#endif
+
+#if THREAD_SAFE
+#include <pthread.h>
+#endif
+#if THREAD_SAFE
+#include <stdatomic.h>
+#endif
+#if LATENCY && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#elif LATENCY
+#include <time.h>
+#endif
+
 #define MIN					5
-#define LEVELS				8
-#define MAX_LEVEL			LEVELS -1	// this is how numbers work
+#define LEVELS				16
+#define MAX_LEVEL			(LEVELS - 1)	// this is how numbers work
 #define PAGE				4096
-#define CACHED_PAGES		4
+#define PAGE_LEVEL			7				// level of a block that spans exactly one PAGE
+#define SUPERBLOCK			(1L << (MAX_LEVEL + MIN))	// 1MB, the unit of memory requested from the OS
+#define TRIM_INTERVAL		16				// number of superblocks returned to the cache between two trims
+#define MAX_COLD_SUPERBLOCKS	64			// decommitted superblocks kept mapped for reuse, the rest is unmapped
+#define HUGE_PAGE			(2L << 20)		// 2MB, a transparent huge page of x86-64 and of aarch64 with 4KB pages
+
+/// Unit of memory mapped from the OS at once, it is aligned to its own size
+#if HUGE_PAGES
+#define REGION				HUGE_PAGE
+#else
+#define REGION				SUPERBLOCK
+#endif
+
+#ifdef MADV_FREE
+#define DECOMMIT_LAZY		MADV_FREE		// the kernel reclaims the pages only once it needs them
+#else
+#define DECOMMIT_LAZY		MADV_DONTNEED
+#endif
+
+#if HUGE_PAGES && !defined(MADV_HUGEPAGE)
+#error "huge pages need MADV_HUGEPAGE"
+#endif
+
+#define MAGAZINE_LEVELS		(PAGE_LEVEL + 1)	// only blocks up to a page are cached per thread
+#define MAGAZINE_SIZE		32				// blocks of a single level a thread may hold on to
+#define MAGAZINE_REFILL		(MAGAZINE_SIZE / 2)	// blocks moved between a magazine and the core at once
+
+#define QUICK_LEVELS		(PAGE_LEVEL + 1)	// only blocks up to a page wait unmerged
+#define QUICK_LIMIT			(256 * PAGE)	// bytes waiting unmerged that make a heap merge them all
+
+#define COMPACT_SCAN		32				// free blocks of a list compared for the fullest page
+
+#define SLAB_CLASSES		8				// number of object sizes carved out of slab pages
+#define SLAB_MAX			128				// largest request served by a slab
+#define SLAB_HEAD_SIZE		64				// objects of a slab start after its head
+
+#define SORT_INSERTION		64				// batches up to this size are sorted by insertion
+#define ALIGNMENT			16				// alignment of every address returned by balloc, as of max_align_t
+
+#define ADDRESS_BITS		48				// bits of a user space address
+#define MAP_BITS			(ADDRESS_BITS - MAX_LEVEL - MIN)	// bits of a superblock number
+#define MAP_LEAF_BITS		(MAP_BITS / 2)
+#define MAP_ROOT_BITS		(MAP_BITS - MAP_LEAF_BITS)
 
 #define check_bounds(x)		assert(x <= MAX_LEVEL)	// redefine this to skip assertion
 
+#if BSTATS_LEVELS != LEVELS || BSTATS_CLASSES != SLAB_CLASSES || BLATENCY_BUCKETS != 64 || BPAGE != PAGE || BSUPERBLOCK != SUPERBLOCK
+#error "buddy.h describes a different tree"
+#endif
+
+/// Statistics counters
+///
+/// Counters of a heap are only written by whoever may touch its lists, so they never need an atomic increment.
+/// With thread heaps they are still read by other threads, so every access is a relaxed atomic (a plain move).
+/// Counters of mappings are shared by all threads, but mapping is a trap to OS anyway.
+#if THREAD_SAFE == THREAD_HEAPS
+typedef _Atomic size_t counter_t;
+#define add_counter(counter, n)		atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + (n), memory_order_relaxed)
+#define read_counter(counter)		atomic_load_explicit(&(counter), memory_order_relaxed)
+#else
+typedef size_t counter_t;
+#define add_counter(counter, n)		((counter) += (n))
+#define read_counter(counter)		(counter)
+#endif // THREAD_HEAPS
+
+#if THREAD_SAFE
+typedef atomic_size_t shared_counter_t;
+#define add_shared(counter, n)		atomic_fetch_add_explicit(&(counter), (n), memory_order_relaxed)
+#define read_shared(counter)		atomic_load_explicit(&(counter), memory_order_relaxed)
+#else
+typedef size_t shared_counter_t;
+#define add_shared(counter, n)		((counter) += (n))
+#define read_shared(counter)		(counter)
+#endif // THREAD_SAFE
+
+#if LATENCY
+/// Latency histograms
+///
+/// Every timed call lands in the bucket of the highest bit of its cycle count, so a bucket spans a power of 2.
+/// Magazines serve blocks without the core lock, so there every thread records into the global heap atomically.
+#if THREAD_SAFE == MAGAZINES
+typedef shared_counter_t latency_t;
+#define add_latency(counter, n)		add_shared(counter, n)
+#define read_latency(counter)		read_shared(counter)
+#else
+typedef counter_t latency_t;
+#define add_latency(counter, n)		add_counter(counter, n)
+#define read_latency(counter)		read_counter(counter)
+#endif // MAGAZINES
+
+/// Depth of the path the current call took, see mark_path
+static __thread int latencyDepth;
+
+/// Note that the current call went deeper than a hit
+///
+/// Depth 1 is a split (or a merge when freeing), depth 2 a trap to OS to map (or unmap) memory
+#define mark_path(depth)			do { if (latencyDepth < (depth)) latencyDepth = (depth); } while (0)
+
+/// Read a cheap cycle counter
+static inline unsigned long long readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#elif defined(__aarch64__)
+	unsigned long long cycles;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(cycles));
+	return cycles;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+#else
+#define mark_path(depth)			do {} while (0)
+#endif // LATENCY
+
 
 typedef int level_t;
 
-enum Flag {Free = 0, Taken = 1};
+/// Mapped blocks are large allocations with a mapping of their own,
+/// their level holds the number of pages of the mapping instead
+/// Aligned heads are only found in front of memory from balloc_aligned that doesn't start its block,
+/// their level holds the distance back to the start in steps of ALIGNMENT
+enum Flag {Free = 0, Taken = 1, Mapped = 2, Aligned = 3};
 
 typedef struct BlockHead {
 	enum Flag	status;
@@ -26,38 +190,600 @@ typedef struct BlockHead {
 typedef struct FreeBlockHead {
 	struct BlockHead		header;
 	struct FreeBlockHead	*next, *prev;
+	int						decommitted;	// all but the first page are given back, only ever set above a page
 } FreeBlockHead;
 
+/// Head of a large allocation of a heap instance
+///
+/// The position of the allocation in the list of its heap fills the padding of the head
+typedef struct LargeHead {
+	struct BlockHead	header;
+	unsigned int		slot;
+} LargeHead;
+
+/// Size of the head in front of the user data of a taken block
+///
+/// Without heads, taken blocks are all user data and only the side table knows their level,
+/// so power of two requests fit their block exactly.
+/// Free blocks (and large mappings) always keep their heads.
+/// A head is padded to ALIGNMENT, so the user data behind it stays aligned.
+#if HEADERLESS
+#define HEAD_SIZE			0
+#else
+#define HEAD_SIZE			ALIGNMENT
+#endif
+
+#define SIDE_FREE			0x80	// flag of a side table entry, the rest of it is the level
+
+/// Out-of-band description of a superblock
+typedef struct Superblock {
+	struct Heap		*owner;
+	struct Superblock	*next, *prev;		// superblocks of the same owner
+	char			*memory;
+#if SLABS
+	unsigned char	slabs[SUPERBLOCK / PAGE];	// set for pages carved into slab objects
+#endif
+#if HEADERLESS
+	unsigned char	levels[SUPERBLOCK >> MIN];	// status and level of the block starting at every granule
+#endif
+#if HUGE_PAGES
+	unsigned char	smallPages;				// advised against huge pages, since some of its pages were given back
+#endif
+#if COMPACT
+	// Bytes in free blocks smaller than the superblock, a fully free superblock counts 0
+	size_t			freeBytes;
+	unsigned short	pageFree[SUPERBLOCK / PAGE];	// bytes in free blocks smaller than a page, by page
+#endif
+} Superblock;
+
+#if SLABS
+/// A page carved into objects of a single size class
+///
+/// The page is a taken buddy block, its objects have no heads at all.
+/// Freed objects form an intrusive list, the never used rest of the page is handed out by bumping a pointer,
+/// so a fresh slab touches only as much of its page as it needs.
+typedef struct Slab {
+	struct BlockHead	header;
+	struct Slab			*next, *prev;	// slabs of the same class with free objects
+	struct Heap			*heap;
+	void				*free;
+	char				*bump;
+	unsigned short		used;
+	unsigned char		sizeClass;
+} Slab;
+
+/// Every class but the smallest is a multiple of ALIGNMENT, nothing that needs more than 8 bytes of alignment fits 8 bytes
+static unsigned short const SLAB_SIZES[SLAB_CLASSES] = {8, 16, 32, 48, 64, 80, 96, 128};
+/// Size class of a request, indexed by the request size in steps of 8 bytes (rounded up)
+static unsigned char const SLAB_CLASS_OF[SLAB_MAX / 8 + 1] = {0, 0, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 7, 7};
+#endif // SLABS
 
-/// Global list of blocks
-static FreeBlockHead *freeBlocks[LEVELS] = {NULL};
-static int num_of_free_pages = 0;
+
+/// A buddy heap
+///
+/// Holds the lists of free blocks and the cache of free superblocks.
+///
+/// Hot superblocks are fully coalesced blocks in freeBlocks[MAX_LEVEL], their pages are still committed.
+/// Cold superblocks were trimmed out of the cache, their pages are decommitted, but they stay mapped.
+/// The number of hot superblocks follows the recent demand:
+/// a high water mark of used superblocks is kept and decays every trim.
+typedef struct Heap {
+	FreeBlockHead	*freeBlocks[LEVELS];
+	unsigned int	freeLevels;				// bit i is set when freeBlocks[i] is not empty
+	
+	int				num_of_free_superblocks;
+	FreeBlockHead	*coldSuperblocks;
+	int				num_of_cold_superblocks;
+	int				num_of_used_superblocks;
+	int				superblock_peak;		// decaying high water mark of used superblocks
+	int				window_peak;			// high water mark since the last trim
+	int				returned_superblocks;	// returned to the cache since the last trim
+	
+	// Statistics, see bstats
+	counter_t		free_blocks[LEVELS];	// length of every list of freeBlocks
+	counter_t		cached_pages;			// pages of hot superblocks
+	counter_t		decommitted_bytes;		// bytes not resident in the decommitted blocks of freeBlocks
+	counter_t		splits;
+	counter_t		merges;
+	counter_t		requested_bytes;		// sizes asked for by all allocations
+	counter_t		allocated_bytes;		// sizes of the blocks and objects handed out for them
+	counter_t		freed_bytes;
+	
+#if LAZY
+	// Freed blocks not merged yet, they stay marked as Taken, so their buddies never merge with them
+	FreeBlockHead	*quickBlocks[QUICK_LEVELS];
+	counter_t		quick_blocks[QUICK_LEVELS];	// length of every list of quickBlocks
+	size_t			quick_bytes;
+#endif
+	
+#if SLABS
+	Slab			*slabs[SLAB_CLASSES];	// slabs with free objects
+	counter_t		slab_objects[SLAB_CLASSES];	// objects in use
+#endif
+
+#if LATENCY
+	latency_t		latency[BPATHS][BLATENCY_BUCKETS];
+	latency_t		latency_max[BPATHS];
+#endif
+	
+	// Everything the heap has mapped, so it can all be dropped at once
+	Superblock		*owned;
+	struct LargeHead	**large;			// large allocations of a heap instance, see bheap_alloc
+	size_t			num_of_large;
+	size_t			large_capacity;
+	size_t			mapped_bytes;
+	size_t			budget;					// limit of mapped_bytes, 0 for none
+#if HUGE_PAGES
+	FreeBlockHead	*spareSuperblock;		// second half of the last region mapped, not counted as mapped until taken
+#endif
+	
+#if THREAD_SAFE == THREAD_HEAPS
+	// Blocks and slab objects freed by other threads, pushed without a lock and drained by the owner
+	// Kept on a cache line of its own, so foreign frees don't disturb the owner
+	_Alignas(64) FreeBlockHead * _Atomic remoteFrees;
+	void * _Atomic	remoteSlabFrees;
+	struct Heap		*nextAbandoned;
+	struct Heap		*nextHeap;				// every heap ever mapped, for bstats
+#endif // THREAD_HEAPS
+} Heap;
+
+#define DESCRIPTOR_PAGES	((sizeof(Superblock) + PAGE - 1) / PAGE)
+#define SUPERBLOCK_PAGES	(SUPERBLOCK / PAGE)
+
+/// Counters of memory mapped from the OS, see bstats
+///
+/// Large allocations never meet a heap, so their requests are counted here too
+static struct {
+	shared_counter_t	mapped_pages;
+	shared_counter_t	returned_pages;			// unmapped or decommitted so far
+	shared_counter_t	requested_bytes;
+	shared_counter_t	allocated_bytes;
+	shared_counter_t	freed_bytes;
+} mappings;
+
+#if THREAD_SAFE != THREAD_HEAPS
+/// The heap behind balloc and bfree
+static Heap globalHeap;
+#endif
+
+#if THREAD_SAFE == MAGAZINES
+/// The global heap is the shared core, guarded by a single lock
+static pthread_mutex_t coreLock = PTHREAD_MUTEX_INITIALIZER;
+#define lock_core()			pthread_mutex_lock(&coreLock)
+#define unlock_core()		pthread_mutex_unlock(&coreLock)
+#else
+#define lock_core()
+#define unlock_core()
+#endif // MAGAZINES
+
+/// Descriptors of superblocks
+///
+/// A two level table indexed by the superblock number, leaves are mapped on demand
+/// The descriptor (and so the owner) of any block is then found from its address alone
+/// Heap instances map superblocks outside of the core lock, so the leaves have a lock of their own
+#if THREAD_SAFE
+static Superblock ** _Atomic superblocks[1 << MAP_ROOT_BITS];
+static pthread_mutex_t heapsLock = PTHREAD_MUTEX_INITIALIZER;
+#else
+static Superblock **superblocks[1 << MAP_ROOT_BITS];
+#endif // THREAD_SAFE
+
+#if THREAD_SAFE == THREAD_HEAPS
+static Heap *abandonedHeaps = NULL;
+static Heap *allHeaps = NULL;
+static __thread Heap *localHeap = NULL;
+static pthread_key_t heapKey;
+static pthread_once_t heapOnce = PTHREAD_ONCE_INIT;
+#endif // THREAD_HEAPS
+
+/// Mark the list of given level as (non) empty in freeLevels
+#define mark_level(heap, level)		(heap)->freeLevels |= (0x1u << (level))
+#define clear_level(heap, level)	(heap)->freeLevels &= ~(0x1u << (level))
 
 /// Map a new block head
 ///
-/// Traps to OS to allocate a new page
+/// Traps to OS to reserve a new superblock, the block of MAX_LEVEL
+/// The superblock is aligned to its own size, so the buddy tree continues above the page
+/// and every page inside of it can be coalesced back into it.
+/// With huge pages a whole region of two superblocks is mapped and advised for them,
+/// the head of the second superblock is written too, it is right behind the returned one.
 FreeBlockHead *newBlock() {
-	FreeBlockHead *new = (FreeBlockHead*) mmap(
-													NULL,							// hint for OS memory location, we let it decide
-													PAGE,							// size of the newly mapped memory
-													PROT_READ | PROT_WRITE,			// access mode
-													MAP_PRIVATE | MAP_ANONYMOUS,	// MAP_PRIVATE is COW page independent of other processes,
-																					// MAP_ANONYMOUS flags the memory to not be backed by any files
-													-1,								// sometimes required to be -1 with MAP_ANONYMOUS, but for the most part ignored
-													0);								// offset should be 0 with ANONYMOUS flag
+	// The OS only guarantees page alignment, so we map twice the size and cut off the unaligned ends
+	char *mapped = (char*) mmap(
+								NULL,							// hint for OS memory location, we let it decide
+								2 * REGION,						// size of the newly mapped memory
+								PROT_READ | PROT_WRITE,			// access mode
+								MAP_PRIVATE | MAP_ANONYMOUS,	// MAP_PRIVATE is COW page independent of other processes,
+																// MAP_ANONYMOUS flags the memory to not be backed by any files
+								-1,								// sometimes required to be -1 with MAP_ANONYMOUS, but for the most part ignored
+								0);								// offset should be 0 with ANONYMOUS flag
 							
-	if (new == MAP_FAILED) {
+	if (mapped == MAP_FAILED) {
 		return NULL;	// this should throw an exception in any reasonable language, but in C malloc is noexcep...
 	}
-	assert(((long int)new & 0xfff) == 0);	// mmap with MAP_ANONYMOUS flag should be preinitialized to 0
 	
-	new->header.status = Free;
-	new->header.level = MAX_LEVEL;
-	new->next = new->prev = NULL;	// technically not necessary, but this is actually important logically
+	char *aligned = (char*)(((long int)mapped + REGION - 1) & ~(REGION - 1));
+	if (aligned != mapped) munmap(mapped, aligned - mapped);
+	munmap(aligned + REGION, mapped + REGION - aligned);
+#if HUGE_PAGES
+	// Advised before the first touch, so the first fault already maps a huge page
+	madvise(aligned, REGION, MADV_HUGEPAGE);
+#endif // HUGE_PAGES
+	
+	for (char *superblock = aligned; superblock < aligned + REGION; superblock += SUPERBLOCK) {
+		FreeBlockHead *new = (FreeBlockHead*) superblock;
+		assert(((long int)new & (SUPERBLOCK - 1)) == 0);	// mmap with MAP_ANONYMOUS flag should be preinitialized to 0
+		
+		new->header.status = Free;
+		new->header.level = MAX_LEVEL;
+		new->next = new->prev = NULL;	// technically not necessary, but this is actually important logically
+		new->decommitted = !HUGE_PAGES;	// nothing is resident before the first touch, unless it faults in a huge page
+	}
+	
+	return (FreeBlockHead*) aligned;
+}
+
+/// Find the slot holding the descriptor of the superblock of given address
+///
+/// Maps the leaf of the table if create is set, otherwise returns NULL for an unknown leaf
+Superblock **superblockSlot(void *address, int create) {
+	unsigned long int number = ((unsigned long int)address >> (MAX_LEVEL + MIN)) & ((1L << MAP_BITS) - 1);
+#if THREAD_SAFE
+	Superblock ** _Atomic *root = &superblocks[number >> MAP_LEAF_BITS];
+	Superblock **leaf = atomic_load_explicit(root, memory_order_acquire);
+#else
+	Superblock ***root = &superblocks[number >> MAP_LEAF_BITS];
+	Superblock **leaf = *root;
+#endif // THREAD_SAFE
+	
+	if (leaf == NULL && create) {
+#if THREAD_SAFE
+		pthread_mutex_lock(&heapsLock);
+		leaf = atomic_load_explicit(root, memory_order_relaxed);
+#endif // THREAD_SAFE
+		if (leaf == NULL) {
+			leaf = (Superblock**) mmap(NULL, sizeof(Superblock*) << MAP_LEAF_BITS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (leaf == MAP_FAILED) {
+				leaf = NULL;
+			} else {
+#if THREAD_SAFE
+				atomic_store_explicit(root, leaf, memory_order_release);
+#else
+				*root = leaf;
+#endif // THREAD_SAFE
+			}
+		}
+#if THREAD_SAFE
+		pthread_mutex_unlock(&heapsLock);
+#endif // THREAD_SAFE
+	}
+	
+	return leaf ? &leaf[number & ((1L << MAP_LEAF_BITS) - 1)] : NULL;
+}
+
+/// Find the descriptor of the superblock holding given address
+///
+/// Returns NULL for addresses outside of superblocks, such as large mappings
+static inline Superblock *descriptor(void *address) {
+	Superblock **slot = superblockSlot(address, 0);
+	return slot ? *slot : NULL;
+}
+
+/// Side table of the superblock holding given block
+///
+/// Only blocks without heads need it, otherwise it is always NULL
+static inline Superblock *sideTable(void *block) {
+#if HEADERLESS
+	return descriptor(block);
+#else
+	(void) block;
+	return NULL;
+#endif // HEADERLESS
+}
+
+/// Record the status of a block
+///
+/// Writes the head and, without heads, the side table entry of the block with its current level
+static inline void setStatus(Superblock *superblock, BlockHead *block, enum Flag status) {
+	block->status = status;
+#if HEADERLESS
+	superblock->levels[((long int)block & (SUPERBLOCK - 1)) >> MIN] = block->level | (status == Free ? SIDE_FREE : 0);
+#else
+	(void) superblock;
+#endif // HEADERLESS
+}
+
+/// Check if there is a free block of given level at given address
+///
+/// A taken block might have no head, so without heads only the side table is consulted
+static inline int isFree(Superblock *superblock, BlockHead *block, level_t level) {
+#if HEADERLESS
+	return superblock->levels[((long int)block & (SUPERBLOCK - 1)) >> MIN] == (level | SIDE_FREE);
+#else
+	(void) superblock;
+	return block->status == Free && block->level == level;
+#endif // HEADERLESS
+}
+
+/// Level of a taken block
+static inline level_t takenLevel(Superblock *superblock, BlockHead *block) {
+#if HEADERLESS
+	return superblock->levels[((long int)block & (SUPERBLOCK - 1)) >> MIN];
+#else
+	(void) superblock;
+	assert(block->status == Taken);
+	return block->level;
+#endif // HEADERLESS
+}
+
+/// Record a new level of a taken block
+///
+/// A taken block without a head holds user data, so only the side table is written then
+static inline void setTakenLevel(Superblock *superblock, BlockHead *block, level_t level) {
+#if HEADERLESS
+	superblock->levels[((long int)block & (SUPERBLOCK - 1)) >> MIN] = level;
+#else
+	(void) superblock;
+	block->level = level;
+#endif // HEADERLESS
+}
+
+/// Check if given memory is an object of a slab
+static inline int isObject(Superblock *superblock, void *memory) {
+#if SLABS
+	return superblock != NULL && superblock->slabs[((long int)memory & (SUPERBLOCK - 1)) / PAGE];
+#else
+	(void) superblock;
+	(void) memory;
+	return 0;
+#endif // SLABS
+}
+
+/// Memory as it was allocated, given memory returned by balloc_aligned
+///
+/// Only memory with a head in front of it may be given, so slab objects (and without heads, blocks) have to be ruled out first
+static inline void *unalign(void *memory) {
+	BlockHead *head = (BlockHead*)((char*)memory - ALIGNMENT);
+	return head->status == Aligned ? (char*)memory - (size_t)head->level * ALIGNMENT : memory;
+}
+
+/// Check if given memory was aligned by balloc_aligned past the start of its block
+///
+/// Slab objects have no head, so they have to be ruled out first
+static inline int isAligned(Superblock *superblock, void *memory) {
+#if HEADERLESS
+	// Blocks are aligned by themselves, only large mappings get aligned heads
+	if (superblock != NULL) return 0;
+#else
+	(void) superblock;
+#endif // HEADERLESS
+	return ((BlockHead*)((char*)memory - ALIGNMENT))->status == Aligned;
+}
+
+/// Head of the mapping of given memory if it is a large block, otherwise NULL
+///
+/// Slab objects have no head, so they have to be ruled out first
+static inline BlockHead *largeHead(Superblock *superblock, void *memory) {
+#if HEADERLESS
+	// Only the side table knows where the block is from
+	if (superblock != NULL) return NULL;
+#else
+	(void) superblock;
+#endif // HEADERLESS
+	BlockHead *block = (BlockHead*)((char*)unalign(memory) - ALIGNMENT);
+	return block->status == Mapped ? block : NULL;
+}
+
+/// Give a superblock back to OS
+void releaseSuperblock(FreeBlockHead *block) {
+	mark_path(2);
+	Superblock **slot = superblockSlot(block, 0);
+	Superblock *superblock = *slot;
+	Heap *heap = superblock->owner;
+	if (superblock->next) superblock->next->prev = superblock->prev;
+	if (superblock->prev) {
+		superblock->prev->next = superblock->next;
+	} else {
+		heap->owned = superblock->next;
+	}
+	heap->mapped_bytes -= SUPERBLOCK;
+	munmap(superblock, sizeof(Superblock));
+	*slot = NULL;
+	munmap(block, SUPERBLOCK);
+	add_shared(mappings.mapped_pages, -(SUPERBLOCK_PAGES + DESCRIPTOR_PAGES));
+	add_shared(mappings.returned_pages, SUPERBLOCK_PAGES + DESCRIPTOR_PAGES);
+}
+
+#if HUGE_PAGES
+/// Let the kernel back a superblock with huge pages again, once it is taken as a whole
+///
+/// The superblock only gets a huge page while the other half of its region is advised for it as well
+static inline void adviseHuge(FreeBlockHead *block) {
+	Superblock *superblock = descriptor(block);
+	if (!superblock->smallPages) return;
+	mark_path(2);
+	superblock->smallPages = 0;
+	madvise(block, SUPERBLOCK, MADV_HUGEPAGE);
+}
+
+/// Fall back to small pages for a superblock some pages of which are about to be given back
+///
+/// Giving them back splits the huge page anyway, the advice keeps the kernel from collapsing it again,
+/// which would bring the given back pages right back
+static inline void adviseSmall(void *block) {
+	Superblock *superblock = descriptor(block);
+	if (superblock->smallPages) return;
+	superblock->smallPages = 1;
+	madvise(superblock->memory, SUPERBLOCK, MADV_NOHUGEPAGE);
+}
+#endif // HUGE_PAGES
+
+/// Take a superblock that is not in the free lists
+///
+/// Prefers reusing a cold superblock over trapping to OS for a new one
+/// A new superblock gets its descriptor mapped next to it
+/// With huge pages the second superblock of the last region mapped is taken before mapping another one
+FreeBlockHead *takeSuperblock(Heap *heap) {
+	FreeBlockHead *block = heap->coldSuperblocks;
+	if (block != NULL) {
+		// The first page was not decommitted, so the head is still intact
+		heap->coldSuperblocks = block->next;
+		heap->num_of_cold_superblocks--;
+		block->next = block->prev = NULL;
+#if HUGE_PAGES
+		adviseHuge(block);
+#endif // HUGE_PAGES
+	} else {
+		if (heap->budget != 0 && heap->mapped_bytes + SUPERBLOCK > heap->budget) return NULL;
+#if HUGE_PAGES
+		block = heap->spareSuperblock;
+		heap->spareSuperblock = NULL;
+		if (block == NULL) {
+			mark_path(2);
+			block = newBlock();
+			if (block == NULL) return NULL;
+			heap->spareSuperblock = (FreeBlockHead*)((char*)block + SUPERBLOCK);
+		}
+#else
+		mark_path(2);
+		block = newBlock();
+		if (block == NULL) return NULL;
+#endif // HUGE_PAGES
+		
+		Superblock **slot = superblockSlot(block, 1);
+		Superblock *superblock = (Superblock*) mmap(NULL, sizeof(Superblock), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (slot == NULL || superblock == MAP_FAILED) {
+			if (superblock != MAP_FAILED) munmap(superblock, sizeof(Superblock));
+			munmap(block, SUPERBLOCK);
+			return NULL;
+		}
+		superblock->owner = heap;
+		superblock->memory = (char*)block;
+		superblock->next = heap->owned;
+		if (heap->owned) heap->owned->prev = superblock;
+		heap->owned = superblock;
+		heap->mapped_bytes += SUPERBLOCK;
+		*slot = superblock;
+		setStatus(superblock, &block->header, Free);
+		add_shared(mappings.mapped_pages, SUPERBLOCK_PAGES + DESCRIPTOR_PAGES);
+	}
+	
+	if (++heap->num_of_used_superblocks > heap->window_peak) heap->window_peak = heap->num_of_used_superblocks;
+	return block;
+}
+
+/// Decommit all but the first page of a free block
+///
+/// The first page holds the block head, so it is kept
+void decommit(FreeBlockHead *block, size_t size, int advice) {
+	mark_path(2);
+#if HUGE_PAGES
+	adviseSmall(block);
+#endif // HUGE_PAGES
+	madvise((char*)block + PAGE, size - PAGE, advice);
+}
+
+/// Trim the cache of hot superblocks down to given number
+///
+/// Trimmed superblocks become cold, unless there are too many cold ones already
+/// Returns the number of bytes given back
+size_t trimCache(Heap *heap, int keep) {
+	size_t released = 0;
+	while (heap->num_of_free_superblocks > keep) {
+		FreeBlockHead *block = heap->freeBlocks[MAX_LEVEL];
+		heap->freeBlocks[MAX_LEVEL] = block->next;
+		if (block->next) {
+			block->next->prev = NULL;
+		} else {
+			clear_level(heap, MAX_LEVEL);
+		}
+		heap->num_of_free_superblocks--;
+		add_counter(heap->free_blocks[MAX_LEVEL], -1);
+		add_counter(heap->cached_pages, -SUPERBLOCK_PAGES);
+		
+		if (heap->num_of_cold_superblocks >= MAX_COLD_SUPERBLOCKS) {
+			releaseSuperblock(block);
+			released += SUPERBLOCK;
+		} else {
+			decommit(block, SUPERBLOCK, DECOMMIT_LAZY);
+			add_shared(mappings.returned_pages, SUPERBLOCK_PAGES - 1);
+			released += SUPERBLOCK - PAGE;
+			block->decommitted = 1;
+			block->next = heap->coldSuperblocks;
+			heap->coldSuperblocks = block;
+			heap->num_of_cold_superblocks++;
+		}
+	}
+	return released;
+}
+
+/// Account for a fully coalesced superblock that is about to join the cache
+///
+/// Every TRIM_INTERVAL returned superblocks the high water mark decays towards the recent demand
+/// and the cache is trimmed in one batch to what that demand might still need
+void returnSuperblock(Heap *heap) {
+	heap->num_of_used_superblocks--;
+	heap->num_of_free_superblocks++;
+	add_counter(heap->cached_pages, SUPERBLOCK_PAGES);
+	
+	if (++heap->returned_superblocks < TRIM_INTERVAL) return;
+	heap->returned_superblocks = 0;
+	
+	heap->superblock_peak = (heap->superblock_peak + heap->window_peak) / 2;
+	if (heap->superblock_peak < heap->window_peak) heap->superblock_peak = heap->window_peak;
+	heap->window_peak = heap->num_of_used_superblocks;
+	
+	trimCache(heap, heap->superblock_peak - heap->num_of_used_superblocks);
+}
+
+/// Number of pages of the mapping of a large allocation of given size
+///
+/// Large allocations always have a head, returns 0 on overflow
+static inline size_t largePages(size_t size) {
+	size_t total = size + ALIGNMENT;
+	if (total < size) return 0;
+	return (total + PAGE - 1) / PAGE;
+}
+
+/// Map a run of pages for a large allocation
+///
+/// Used for requests that don't fit into a single superblock
+/// Traps to OS directly, the run of pages is unmapped again as soon as it is freed
+BlockHead *newLargeBlock(size_t size) {
+	size_t pages = largePages(size);
+	if (pages == 0 || pages > INT_MAX) return NULL;
+	mark_path(2);
+	
+	BlockHead *new = (BlockHead*) mmap(NULL, pages * PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (new == MAP_FAILED) return NULL;
 	
+	new->status = Mapped;
+	new->level = (level_t) pages;
+	add_shared(mappings.mapped_pages, pages);
+	add_shared(mappings.requested_bytes, size);
+	add_shared(mappings.allocated_bytes, pages * PAGE);
 	return new;
 }
 
+/// Unmap the run of pages of a large allocation
+void releaseLarge(BlockHead *large) {
+	mark_path(2);
+	size_t pages = (size_t) large->level;
+	munmap(large, pages * PAGE);
+	add_shared(mappings.mapped_pages, -pages);
+	add_shared(mappings.returned_pages, pages);
+	add_shared(mappings.freed_bytes, pages * PAGE);
+}
+
+/// User memory of a large block, behind its head padded to ALIGNMENT
+static inline void *hideLarge(BlockHead *large) {
+	return (void*)((char*)large + ALIGNMENT);
+}
+
+static inline BlockHead *unhideLarge(void *memory) {
+	return (BlockHead*)((char*)memory - ALIGNMENT);
+}
+
 /// Find a buddy (second half of a larger block) of a given block
 ///
 /// This is done by flipping the bit that differenciates the given block from the body
@@ -80,6 +806,8 @@ FreeBlockHead *split(FreeBlockHead *block) {
 	new->header.level = index;
 	new->header.status = Free;
 	new->prev = new->next = NULL;
+	// The pages of the upper half of a decommitted block stay given back, but for the one of the new head
+	new->decommitted = block->decommitted && index > PAGE_LEVEL;
 	
 	return new;
 }
@@ -112,62 +840,155 @@ FreeBlockHead *merge(FreeBlockHead *block) {
 }
 
 void *hideHead(BlockHead *block) {
-	return (void*)(block + 1);
+	return (void*)((char*)block + HEAD_SIZE);
 }
 
 BlockHead *unhideHead(void *memory) {
-	return ((struct BlockHead*)memory - 1);
+	return (BlockHead*)((char*)memory - HEAD_SIZE);
 }
 
 /// Find the level of the necessary block for a given requested memory amount
 ///
 /// Find find the smallest block size that fits both the requested size of the data as well as the block head for that data
-int level(int requestedSize) {
-	int total = requestedSize + sizeof(struct BlockHead);
+/// The level is the position of the highest set bit of (total - 1), so it is computed with a single clz
+int level(size_t requestedSize) {
+	size_t total = requestedSize + HEAD_SIZE;
 	
-	level_t level = 0;
-	int size = 1 << MIN;
-	while (size < total) {
-		size <<= 1;
-		level++;
+	if (total < requestedSize) return INT_MAX;	// overflow, can't be served by any level
+	if (total <= (1 << MIN)) return 0;
+	return (int)(sizeof(unsigned long) * 8) - __builtin_clzl(total - 1) - MIN;
+}
+
+/// Account for a block of given level joining (1) or leaving (-1) the free lists
+///
+/// Keeps the free bytes of its superblock and, below a page, of its page, see densest
+static inline void countFree(void *block, level_t level, long int sign) {
+#if COMPACT
+	if (level == MAX_LEVEL) return;
+	Superblock *superblock = descriptor(block);
+	long int size = sign * (1L << (level + MIN));
+	superblock->freeBytes += size;
+	if (level < PAGE_LEVEL) superblock->pageFree[((long int)block & (SUPERBLOCK - 1)) / PAGE] += size;
+#else
+	(void) block;
+	(void) level;
+	(void) sign;
+#endif // COMPACT
+}
+
+/// Remove a free block from the list of given level
+void unlinkFree(Heap *heap, FreeBlockHead *block, level_t level) {
+	if (block->next) block->next->prev = block->prev;
+	if (block->prev) block->prev->next = block->next;
+	if (heap->freeBlocks[level] == block) {
+		heap->freeBlocks[level] = block->next;
+		if (heap->freeBlocks[level] == NULL) clear_level(heap, level);
 	}
-	
-	return level;
+	add_counter(heap->free_blocks[level], -1);
+	countFree(block, level, -1);
+	if (block->decommitted) add_counter(heap->decommitted_bytes, -((1L << (level + MIN)) - PAGE));
+}
+
+#if COMPACT
+/// Free bytes around a free block of given level, the fewer the fuller
+///
+/// Below a page this is the free bytes of its page, from a page up pages are all free, so its superblock decides.
+/// The superblock breaks ties between pages too
+static inline size_t freeAround(FreeBlockHead *block, level_t level) {
+	Superblock *superblock = descriptor(block);
+	size_t page = level < PAGE_LEVEL ? superblock->pageFree[((long int)block & (SUPERBLOCK - 1)) / PAGE] : 0;
+	return (page << (MAX_LEVEL + MIN + 1)) + superblock->freeBytes;
 }
 
+/// Pick the free block of given level in the fullest page (or superblock) among the first ones of its list
+///
+/// New blocks go where most of the memory is taken already, so sparse pages and superblocks drain and coalesce,
+/// ready to be decommitted or cached. Only COMPACT_SCAN blocks are compared, the most recently freed one wins ties
+static inline FreeBlockHead *densest(FreeBlockHead *block, level_t level) {
+	FreeBlockHead *best = block;
+	size_t fewest = freeAround(block, level);
+	for (int scanned = 1; scanned < COMPACT_SCAN && (block = block->next) != NULL; ++scanned) {
+		size_t free = freeAround(block, level);
+		if (free < fewest) {
+			best = block;
+			fewest = free;
+		}
+	}
+	return best;
+}
+#endif // COMPACT
+
+#if LAZY
+void flushQuick(Heap *heap);	// merges through insert, see below
+#endif // LAZY
+
 /// Get the next free block of given level
 ///
-/// First checks if there is a free block of given size
-/// if there is one - returns it.
-/// If there isn't one - recursively tries to find a larger free block
-/// If the largest possible block (a full page) is still not found
-/// requests the kernel to allocate a new page and unwinds the call stack.
-FreeBlockHead *find(int level) {
-	if (freeBlocks[level] != NULL) {
-		// Turns out we already have a free block of right size
-		FreeBlockHead *returnedBlock = freeBlocks[level];
+/// With lazy merging a block of exactly given level freed before is taken back first, as it is.
+/// Otherwise looks up the smallest non-empty list of at least given level in freeLevels
+/// and takes its head.
+/// If there is no such list (not even a full superblock) requests the kernel to reserve a new superblock.
+/// The taken block is then split down to the requested level,
+/// pushing the unused upper halves to their (necessarily empty) lists on the way.
+FreeBlockHead *find(Heap *heap, int level) {
+	check_bounds(level);
+	FreeBlockHead *block;
+#if LAZY
+	if (level < QUICK_LEVELS && heap->quickBlocks[level] != NULL) {
+		block = heap->quickBlocks[level];
+		heap->quickBlocks[level] = block->next;
+		add_counter(heap->quick_blocks[level], -1);
+		heap->quick_bytes -= (size_t)1 << (level + MIN);
+		return block;
+	}
+#endif // LAZY
+	unsigned int available = heap->freeLevels & (~0x0u << level);
+#if LAZY
+	// Nothing large enough is free, the blocks waiting unmerged might make something before a new superblock is taken
+	if (available == 0 && heap->quick_bytes != 0) {
+		flushQuick(heap);
+		available = heap->freeLevels & (~0x0u << level);
+	}
+#endif // LAZY
+	
+	if (available != 0) {
+		level_t index = __builtin_ctz(available);
+		block = heap->freeBlocks[index];
+#if COMPACT
+		if (index != MAX_LEVEL) block = densest(block, index);
+#endif // COMPACT
 		// Because of freeing we might have a non-adjacent free page
-		freeBlocks[level] = freeBlocks[level]->next;
-		if (level == MAX_LEVEL) num_of_free_pages--;
-		return returnedBlock;
-	} else {
-		// We need to create a new block of the right size
-		if (level == MAX_LEVEL) {
-			// We don't have a free page, so get a new one
-			return newBlock();
-		} else {
-			// We find a free bigger block and split it
-			// Note: since we find a bigger block the buddy of the returned block is free
-			// so we append it to the list
-			FreeBlockHead *parent = find(level + 1);
-			if (parent->prev) parent->prev->next = parent->next;
-			if (parent->next) parent->next->prev = parent->prev;
-			// We lower the level of the parent, so it doesn't belong to its list any more
-			parent->prev = parent->next = NULL;
-			freeBlocks[level] = parent;	// We know freeBlocks[level] is NULL
-			return split(parent);
+		unlinkFree(heap, block, index);
+		if (index == MAX_LEVEL) {
+#if HUGE_PAGES
+			adviseHuge(block);
+#endif // HUGE_PAGES
+			heap->num_of_free_superblocks--;
+			add_counter(heap->cached_pages, -SUPERBLOCK_PAGES);
+			if (++heap->num_of_used_superblocks > heap->window_peak) heap->window_peak = heap->num_of_used_superblocks;
 		}
+	} else {
+		// We don't have a free superblock, so get a new one
+		block = takeSuperblock(heap);
+		if (block == NULL) return NULL;
 	}
+	
+	// Note: every list between level and the taken block level is empty, otherwise we would have taken it
+	// The lower half is kept, so a new block is a primary one and its free buddy lets it grow in place
+	Superblock *superblock = sideTable(block);
+	add_counter(heap->splits, block->header.level - level);
+	if (block->header.level > level) mark_path(1);
+	while (block->header.level > level) {
+		FreeBlockHead *upper = split(block);
+		setStatus(superblock, &upper->header, Free);
+		heap->freeBlocks[upper->header.level] = upper;
+		mark_level(heap, upper->header.level);
+		add_counter(heap->free_blocks[upper->header.level], 1);
+		countFree(upper, upper->header.level, 1);
+		if (upper->decommitted) add_counter(heap->decommitted_bytes, ((size_t)1 << (upper->header.level + MIN)) - PAGE);
+	}
+	
+	return block;
 }
 
 /// Insert the block back into the list
@@ -176,64 +997,1399 @@ FreeBlockHead *find(int level) {
 /// If it is - merge and recursively insert the resulting larger block
 /// If it isn't - push the fresh block to the freeBlocks list
 /// Don't forget to mark the block as free
-void insert(FreeBlockHead *block) {
+/// Decommitted tells that all but the first page of the block are not resident, it is dropped by a merge
+void insert(Heap *heap, FreeBlockHead *block, int decommitted) {
+	Superblock *superblock = sideTable(block);
 	level_t level = block->header.level;
-	// Since merging pages doesn't make sense check that this isn't a a full page
-	if (level != MAX_LEVEL) {
+	// Since merging superblocks doesn't make sense check that this isn't a full superblock
+	// Pages inside of a superblock are merged just like any smaller blocks
+	while (level != MAX_LEVEL) {
 		BlockHead *bud = buddy((BlockHead*)block);
 		// This if is not obvious, but we are guaranteed (with correct free use)
 		// That the buddy address is not user data, but a buddy head
 		// However that buddy might be of a lower level, thus unmergable
-		if (bud->status == Free && bud->level == level) {
-			FreeBlockHead *freeBuddy = (FreeBlockHead*)bud;
-			if (freeBuddy->next) freeBuddy->next->prev = freeBuddy->prev;
-			if (freeBuddy->prev) freeBuddy->prev->next = freeBuddy->next;
-			if (freeBlocks[level] == freeBuddy) {
-				// The buddy is about to be merged, so its level is about to be incremented
-				freeBlocks[level] = freeBuddy->next;
-			}
-			block = merge(block);
-			return insert(block);	// eventually the biggest free block will be marked as Free, we can avoid doing it eagerly here
-		}
-	} else {
-		if (num_of_free_pages == CACHED_PAGES) {
-			munmap(block, PAGE);
-			return;
-		} else {
-			num_of_free_pages++;
-		}
+		if (!isFree(superblock, bud, level)) break;
+		
+		unlinkFree(heap, (FreeBlockHead*)bud, level);
+		// eventually the biggest free block will be marked as Free, we can avoid doing it eagerly here
+		block = merge(block);
+		level = block->header.level;
+		add_counter(heap->merges, 1);
+		mark_path(1);
+		// The first page of the buddy is resident, it held a head
+		decommitted = 0;
 	}
 	
-	if (freeBlocks[level] != NULL) {
-		freeBlocks[level]->prev = block;
-		block->next = freeBlocks[level];
+	if (heap->freeBlocks[level] != NULL) {
+		heap->freeBlocks[level]->prev = block;
+		block->next = heap->freeBlocks[level];
 	} else {
 		block->next = NULL;
 	}
 	block->prev = NULL;
-	block->header.status = Free;
-	freeBlocks[level] = block;
+	block->decommitted = decommitted;
+	setStatus(superblock, &block->header, Free);
+	heap->freeBlocks[level] = block;
+	mark_level(heap, level);
+	add_counter(heap->free_blocks[level], 1);
+	countFree(block, level, 1);
+	if (decommitted) add_counter(heap->decommitted_bytes, ((size_t)1 << (level + MIN)) - PAGE);
+	
+	if (level == MAX_LEVEL) returnSuperblock(heap);
 }
 
-/// Allocate size bytes of memory
-void *balloc(size_t size) {
+#if LAZY
+/// Merge every block waiting on the quick lists into the free lists
+///
+/// Done once the heap runs out of large enough free blocks, once too many bytes wait, and by btrim
+void flushQuick(Heap *heap) {
+	for (level_t level = 0; level < QUICK_LEVELS; ++level) {
+		FreeBlockHead *block = heap->quickBlocks[level];
+		heap->quickBlocks[level] = NULL;
+		heap->quick_blocks[level] = 0;
+		while (block != NULL) {
+			FreeBlockHead *next = block->next;
+			block->next = block->prev = NULL;
+			insert(heap, block, 0);
+			block = next;
+		}
+	}
+	heap->quick_bytes = 0;
+}
+#endif // LAZY
+
+/// Give a freed block back to the heap
+///
+/// With lazy merging, a block up to a page waits on the quick list of its level instead of merging right away,
+/// so the next request of its size takes it back without splitting again
+static inline void pushFreed(Heap *heap, FreeBlockHead *block) {
+#if LAZY
+	level_t level = block->header.level;
+	if (level < QUICK_LEVELS) {
+		block->next = heap->quickBlocks[level];
+		heap->quickBlocks[level] = block;
+		add_counter(heap->quick_blocks[level], 1);
+		heap->quick_bytes += (size_t)1 << (level + MIN);
+		if (heap->quick_bytes > QUICK_LIMIT) flushQuick(heap);
+		return;
+	}
+#endif // LAZY
+	// used to be user data, so we clean this
+	block->next = block->prev = NULL;
+	insert(heap, block, 0);
+}
+
+/// Check that none but the first page of a block larger than a page is resident
+///
+/// Nothing tracks the pages of a taken block, its owner may have touched any of them, so the kernel is asked
+static int untouched(void *block, size_t size) {
+	unsigned char resident[SUPERBLOCK_PAGES];
+	size_t pages = size / PAGE - 1;
+	if (mincore((char*)block + PAGE, pages * PAGE, resident) != 0) return 0;
+	for (size_t page = 0; page < pages; ++page) {
+		if (resident[page] & 1) return 0;
+	}
+	return 1;
+}
+
+/// Change the level of a taken block without moving it
+///
+/// Shrinking splits the block and inserts the upper halves back.
+/// Growing merges the block with its free buddies, which is only possible while the block is the primary one.
+/// Returns 0 if the block can't grow to given level in place, nothing is changed then
+int resize(Heap *heap, BlockHead *block, level_t level) {
+	Superblock *superblock = sideTable(block);
+	level_t current = takenLevel(superblock, block);
+	if (level < current) {
+		add_counter(heap->splits, current - level);
+		while (current > level) {
+			--current;
+			FreeBlockHead *upper = (FreeBlockHead*)((long int)block | (0x1L << (current + MIN)));
+			// The upper half used to be user data
+			upper->header.level = current;
+			upper->next = upper->prev = NULL;
+			insert(heap, upper, current > PAGE_LEVEL && untouched(upper, (size_t)1 << (current + MIN)));
+		}
+		setTakenLevel(superblock, block, level);
+		return 1;
+	}
+	
+	// Check the whole chain first, a partial merge would have to be undone
+	for (level_t index = current; index < level; ++index) {
+		BlockHead *bud = (BlockHead*)((long int)block ^ (0x1L << (index + MIN)));
+		if (bud < block || !isFree(superblock, bud, index)) return 0;
+	}
+	for (level_t index = current; index < level; ++index) {
+		unlinkFree(heap, (FreeBlockHead*)((long int)block ^ (0x1L << (index + MIN))), index);
+	}
+	add_counter(heap->merges, level - current);
+	setTakenLevel(superblock, block, level);
+	return 1;
+}
+
+/// Account for a request of given size served by given number of bytes
+///
+/// Expects to be allowed to touch the lists of the heap
+static inline void countRequest(Heap *heap, size_t size, size_t allocated) {
+	add_counter(heap->requested_bytes, size);
+	add_counter(heap->allocated_bytes, allocated);
+}
+
+#if SLABS
+/// Slab holding given object
+static inline Slab *slabOf(void *object) {
+	return (Slab*)((long int)object & ~(long int)(PAGE - 1));
+}
+
+/// Check if none of the objects of a slab are left
+static inline int slabFull(Slab *slab) {
+	return slab->free == NULL && slab->bump + SLAB_SIZES[slab->sizeClass] > (char*)slab + PAGE;
+}
+
+void pushSlab(Heap *heap, Slab *slab) {
+	slab->prev = NULL;
+	slab->next = heap->slabs[slab->sizeClass];
+	if (slab->next) slab->next->prev = slab;
+	heap->slabs[slab->sizeClass] = slab;
+}
+
+void unlinkSlab(Heap *heap, Slab *slab) {
+	if (slab->next) slab->next->prev = slab->prev;
+	if (slab->prev) {
+		slab->prev->next = slab->next;
+	} else {
+		heap->slabs[slab->sizeClass] = slab->next;
+	}
+	slab->next = slab->prev = NULL;
+}
+
+/// Carve a page of the heap into a new slab of given class
+Slab *newSlab(Heap *heap, int sizeClass) {
+	Slab *slab = (Slab*)find(heap, PAGE_LEVEL);
+	if (slab == NULL) return NULL;
+	
+	Superblock *superblock = descriptor(slab);
+	setStatus(superblock, &slab->header, Taken);
+	superblock->slabs[((long int)slab & (SUPERBLOCK - 1)) / PAGE] = 1;
+	
+	slab->heap = heap;
+	slab->free = NULL;
+	slab->bump = (char*)slab + SLAB_HEAD_SIZE;
+	slab->used = 0;
+	slab->sizeClass = sizeClass;
+	pushSlab(heap, slab);
+	return slab;
+}
+
+/// Give the page of an empty slab back to the buddy tree
+void releaseSlab(Heap *heap, Slab *slab) {
+	unlinkSlab(heap, slab);
+	descriptor(slab)->slabs[((long int)slab & (SUPERBLOCK - 1)) / PAGE] = 0;
+	slab->header.level = PAGE_LEVEL;
+	insert(heap, (FreeBlockHead*)slab, 0);
+}
+
+/// Take an object for a request of given size
+///
+/// A pointer pop from the first slab of the class with free objects
+void *slabAlloc(Heap *heap, size_t size) {
+	int sizeClass = SLAB_CLASS_OF[(size + 7) >> 3];
+	Slab *slab = heap->slabs[sizeClass];
+	if (slab == NULL) {
+		slab = newSlab(heap, sizeClass);
+		if (slab == NULL) return NULL;
+	}
+	
+	void *object = slab->free;
+	if (object != NULL) {
+		slab->free = *(void**)object;
+	} else {
+		object = slab->bump;
+		slab->bump += SLAB_SIZES[sizeClass];
+	}
+	slab->used++;
+	countRequest(heap, size, SLAB_SIZES[sizeClass]);
+	add_counter(heap->slab_objects[sizeClass], 1);
+	
+	// Full slabs leave the list, freeing any of their objects brings them back
+	if (slabFull(slab)) unlinkSlab(heap, slab);
+	return object;
+}
+
+/// Return an object to its slab
+///
+/// Keeps a single empty slab per class, any other empty slab is given back
+void slabFree(Heap *heap, void *object) {
+	Slab *slab = slabOf(object);
+	int wasFull = slabFull(slab);
+	*(void**)object = slab->free;
+	slab->free = object;
+	slab->used--;
+	add_counter(heap->freed_bytes, SLAB_SIZES[slab->sizeClass]);
+	add_counter(heap->slab_objects[slab->sizeClass], -1);
+	
+	if (wasFull) {
+		pushSlab(heap, slab);
+	} else if (slab->used == 0 && (heap->slabs[slab->sizeClass] != slab || slab->next != NULL)) {
+		releaseSlab(heap, slab);
+	}
+}
+#endif // SLABS
+
+#if THREAD_SAFE == MAGAZINES
+/// Per thread cache of blocks
+///
+/// Each thread keeps a small magazine of blocks per level in front of the shared core.
+/// Blocks in a magazine stay marked as Taken, so the core never merges them.
+/// Only refilling an empty magazine or flushing a full one takes the core lock.
+/// The same goes for the statistics of requests served by the magazines, they join the core with the blocks.
+typedef struct Magazines {
+	FreeBlockHead	*blocks[MAGAZINE_LEVELS];
+	int				count[MAGAZINE_LEVELS];
+	size_t			requested_bytes;
+	size_t			allocated_bytes;
+	size_t			freed_bytes;
+} Magazines;
+
+static __thread Magazines magazines;
+static pthread_key_t magazinesKey;
+static pthread_once_t magazinesOnce = PTHREAD_ONCE_INIT;
+
+/// Add the statistics of a magazine to the core
+///
+/// Expects the core lock to be held
+void flushCounters(Magazines *cache) {
+	countRequest(&globalHeap, cache->requested_bytes, cache->allocated_bytes);
+	add_counter(globalHeap.freed_bytes, cache->freed_bytes);
+	cache->requested_bytes = cache->allocated_bytes = cache->freed_bytes = 0;
+}
+
+/// Give given number of blocks of a magazine back to the core
+///
+/// Expects the core lock to be held
+void flushMagazine(Magazines *cache, level_t level, int count) {
+	flushCounters(cache);
+	while (count-- > 0 && cache->blocks[level] != NULL) {
+		FreeBlockHead *block = cache->blocks[level];
+		cache->blocks[level] = block->next;
+		cache->count[level]--;
+		block->next = block->prev = NULL;
+		insert(&globalHeap, block, 0);
+	}
+}
+
+/// Return all blocks of an exiting thread
+void releaseMagazines(void *cache) {
+	lock_core();
+	for (level_t level = 0; level < MAGAZINE_LEVELS; ++level) {
+		flushMagazine((Magazines*)cache, level, MAGAZINE_SIZE);
+	}
+	unlock_core();
+}
+
+void createMagazinesKey() {
+	pthread_key_create(&magazinesKey, &releaseMagazines);
+}
+
+/// Take a block of given level from the thread magazine
+///
+/// Refills an empty magazine from the core first
+BlockHead *magazinePop(level_t level) {
+	if (magazines.count[level] == 0) {
+		// First use of the magazines in this thread, make sure they are returned when it exits
+		pthread_once(&magazinesOnce, &createMagazinesKey);
+		if (pthread_getspecific(magazinesKey) == NULL) pthread_setspecific(magazinesKey, &magazines);
+		
+		lock_core();
+		flushCounters(&magazines);
+		while (magazines.count[level] < MAGAZINE_REFILL) {
+			FreeBlockHead *block = find(&globalHeap, level);
+			if (block == NULL) break;
+			setStatus(sideTable(block), &block->header, Taken);
+			block->next = magazines.blocks[level];
+			magazines.blocks[level] = block;
+			magazines.count[level]++;
+		}
+		unlock_core();
+		if (magazines.count[level] == 0) return NULL;
+	}
+	
+	FreeBlockHead *block = magazines.blocks[level];
+	magazines.blocks[level] = block->next;
+	magazines.count[level]--;
+	return &block->header;
+}
+
+/// Put a freed block into the thread magazine
+///
+/// Flushes half of a full magazine to the core first
+void magazinePush(FreeBlockHead *block) {
+	level_t level = block->header.level;
+	if (magazines.count[level] == MAGAZINE_SIZE) {
+		lock_core();
+		flushMagazine(&magazines, level, MAGAZINE_SIZE - MAGAZINE_REFILL);
+		unlock_core();
+	}
+	block->next = magazines.blocks[level];
+	magazines.blocks[level] = block;
+	magazines.count[level]++;
+}
+#endif // MAGAZINES
+
+#if THREAD_SAFE == THREAD_HEAPS
+/// Insert all blocks other threads have freed into the heap
+void drainRemoteFrees(Heap *heap) {
+	FreeBlockHead *block = atomic_exchange_explicit(&heap->remoteFrees, NULL, memory_order_acquire);
+	while (block != NULL) {
+		FreeBlockHead *next = block->next;
+		add_counter(heap->freed_bytes, (size_t)1 << (block->header.level + MIN));
+		pushFreed(heap, block);
+		block = next;
+	}
+#if SLABS
+	// Slab objects might be too small for a free block head, so they are linked through their first word
+	void *object = atomic_exchange_explicit(&heap->remoteSlabFrees, NULL, memory_order_acquire);
+	while (object != NULL) {
+		void *next = *(void**)object;
+		slabFree(heap, object);
+		object = next;
+	}
+#endif // SLABS
+}
+
+/// Check if other threads have freed anything of the heap
+static inline int hasRemoteFrees(Heap *heap) {
+#if SLABS
+	if (atomic_load_explicit(&heap->remoteSlabFrees, memory_order_relaxed) != NULL) return 1;
+#endif // SLABS
+	return atomic_load_explicit(&heap->remoteFrees, memory_order_relaxed) != NULL;
+}
+
+/// Queue a block freed by a foreign thread to its owner
+///
+/// Lock-free push, the owner takes the whole queue at once, so there is no ABA problem
+void pushRemoteFree(Heap *heap, FreeBlockHead *block) {
+	FreeBlockHead *head = atomic_load_explicit(&heap->remoteFrees, memory_order_relaxed);
+	do {
+		block->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&heap->remoteFrees, &head, block, memory_order_release, memory_order_relaxed));
+}
+
+#if SLABS
+/// Queue a slab object freed by a foreign thread to its owner
+void pushRemoteSlabFree(Heap *heap, void *object) {
+	void *head = atomic_load_explicit(&heap->remoteSlabFrees, memory_order_relaxed);
+	do {
+		*(void**)object = head;
+	} while (!atomic_compare_exchange_weak_explicit(&heap->remoteSlabFrees, &head, object, memory_order_release, memory_order_relaxed));
+}
+#endif // SLABS
+
+/// Hand the heap of an exiting thread over to the next new thread
+///
+/// Its blocks might still be in use (and freed remotely), so the heap is never destroyed
+void abandonHeap(void *heap) {
+	drainRemoteFrees((Heap*)heap);
+	pthread_mutex_lock(&heapsLock);
+	((Heap*)heap)->nextAbandoned = abandonedHeaps;
+	abandonedHeaps = (Heap*)heap;
+	pthread_mutex_unlock(&heapsLock);
+	localHeap = NULL;
+}
+
+void createHeapKey() {
+	pthread_key_create(&heapKey, &abandonHeap);
+}
+
+/// Get a heap for a thread that has none yet
+///
+/// Adopts an abandoned heap if there is one, otherwise maps a new one
+Heap *acquireHeap() {
+	pthread_once(&heapOnce, &createHeapKey);
+	
+	pthread_mutex_lock(&heapsLock);
+	Heap *heap = abandonedHeaps;
+	if (heap != NULL) abandonedHeaps = heap->nextAbandoned;
+	pthread_mutex_unlock(&heapsLock);
+	
+	if (heap == NULL) {
+		heap = (Heap*) mmap(NULL, sizeof(Heap), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (heap == MAP_FAILED) return NULL;
+		
+		pthread_mutex_lock(&heapsLock);
+		heap->nextHeap = allHeaps;
+		allHeaps = heap;
+		pthread_mutex_unlock(&heapsLock);
+	}
+	heap->nextAbandoned = NULL;
+	pthread_setspecific(heapKey, heap);
+	return heap;
+}
+
+/// Heap of the calling thread
+static inline Heap *getHeap() {
+	if (localHeap == NULL) localHeap = acquireHeap();
+	return localHeap;
+}
+#else
+static inline Heap *getHeap() {
+	return &globalHeap;
+}
+#endif // THREAD_HEAPS
+
+/// Take a block of given level for a request of given size, bypassing the slabs
+static inline void *takeBlock(Heap *heap, int index, size_t size) {
+#if THREAD_SAFE == MAGAZINES
+	if (index < MAGAZINE_LEVELS) {
+		BlockHead *block = magazinePop(index);
+		if (block == NULL) return NULL;
+		magazines.requested_bytes += size;
+		magazines.allocated_bytes += (size_t)1 << (index + MIN);
+		return hideHead(block);
+	}
+#endif // MAGAZINES
+	lock_core();
+	BlockHead *block = (BlockHead*)find(heap, index);
+	if (block != NULL) {
+		setStatus(sideTable(block), block, Taken);
+		countRequest(heap, size, (size_t)1 << (index + MIN));
+	}
+	unlock_core();
+	return block ? hideHead(block) : NULL;
+}
+
+/// Take given number of blocks of given level at once
+///
+/// Blocks already free at given level go first, the rest is carved out of a larger block split just once
+/// (one per superblock, if they don't fit into a single one).
+/// Returns the number of blocks taken, less than asked for only if there is not enough memory
+size_t takeBlocks(Heap *heap, int index, size_t count, void **memory) {
+	size_t taken = 0;
+	while (taken < count && heap->freeBlocks[index] != NULL) {
+		BlockHead *block = (BlockHead*)find(heap, index);
+		setStatus(sideTable(block), block, Taken);
+		memory[taken++] = hideHead(block);
+	}
+	
+	while (taken < count) {
+		// Smallest block holding all of the remaining pieces
+		int extra = count - taken == 1 ? 0 : (int)(sizeof(unsigned long) * 8) - __builtin_clzl(count - taken - 1);
+		if (index + extra > MAX_LEVEL) extra = MAX_LEVEL - index;
+		char *base = (char*)find(heap, index + extra);
+		if (base == NULL) break;
+		// Pieces given back stay decommitted with the block they come from, as they do when it is split
+		int decommitted = ((FreeBlockHead*)base)->decommitted;
+		
+		Superblock *superblock = sideTable(base);
+		size_t piece = (size_t)1 << (index + MIN);
+		size_t total = (size_t)1 << extra;
+		size_t pieces = count - taken < total ? count - taken : total;
+		for (size_t i = 0; i < pieces; ++i) {
+			BlockHead *block = (BlockHead*)(base + i * piece);
+			block->level = index;
+			setStatus(superblock, block, Taken);
+			memory[taken++] = hideHead(block);
+		}
+		// The rest consists of aligned blocks growing towards the end, each of their buddies holds a taken piece
+		// Every block but the first one came out of a split
+		add_counter(heap->splits, pieces - 1);
+		for (size_t offset = pieces; offset < total; offset += offset & -offset) {
+			FreeBlockHead *block = (FreeBlockHead*)(base + offset * piece);
+			block->header.level = index + __builtin_ctzl(offset);
+			block->next = block->prev = NULL;
+			insert(heap, block, decommitted && block->header.level > PAGE_LEVEL);
+			add_counter(heap->splits, 1);
+		}
+	}
+	return taken;
+}
+
+static inline void *allocate(size_t size) {
 	if (size == 0) return NULL;
 	
 	int index = level(size);
-	check_bounds(index);	// in-source functions do no parameter checking, since the developer is hopefully not an idiot
-	BlockHead *block = (BlockHead*)find(index);
-	block->status = Taken;
-	return hideHead(block);
+	// Anything larger than a superblock gets its own mapping
+	if (index > MAX_LEVEL) {
+		BlockHead *large = newLargeBlock(size);
+		return large ? hideLarge(large) : NULL;
+	}
+	Heap *heap = getHeap();
+#if THREAD_SAFE == THREAD_HEAPS
+	if (heap == NULL) return NULL;
+	if (hasRemoteFrees(heap)) drainRemoteFrees(heap);
+#endif // THREAD_HEAPS
+#if SLABS
+	// Tiny requests never reach the buddy tree
+	if (size <= SLAB_MAX) {
+		lock_core();
+		void *object = slabAlloc(heap, size);
+		unlock_core();
+		return object;
+	}
+#endif // SLABS
+	return takeBlock(heap, index, size);
+}
+
+/// Allocate count blocks of size bytes at once
+size_t balloc_batch(size_t size, size_t count, void **memory) {
+	if (size == 0) return 0;
+	
+	int index = level(size);
+	if (index > MAX_LEVEL) {
+		size_t taken = 0;
+		while (taken < count && (memory[taken] = balloc(size)) != NULL) taken++;
+		return taken;
+	}
+	Heap *heap = getHeap();
+#if THREAD_SAFE == THREAD_HEAPS
+	if (heap == NULL) return 0;
+	if (hasRemoteFrees(heap)) drainRemoteFrees(heap);
+#endif // THREAD_HEAPS
+	// Magazines are passed, the whole batch costs a single trip to the core
+	size_t taken = 0;
+	lock_core();
+#if SLABS
+	if (size <= SLAB_MAX) {
+		while (taken < count && (memory[taken] = slabAlloc(heap, size)) != NULL) taken++;
+		unlock_core();
+		return taken;
+	}
+#endif // SLABS
+	taken = takeBlocks(heap, index, count, memory);
+	countRequest(heap, taken * size, taken << (index + MIN));
+	unlock_core();
+	return taken;
+}
+
+/// Allocate size bytes of memory aligned to given power of 2
+void *balloc_aligned(size_t size, size_t alignment) {
+	if ((alignment & (alignment - 1)) != 0) return NULL;
+	// Only the smallest requests are less aligned than any balloc address
+	if (alignment <= ALIGNMENT) return size ? balloc(size < alignment ? alignment : size) : NULL;
+	
+	// A head in front of a block breaks its alignment,
+	// so the block grows by the alignment and the aligned memory inside it gets a head pointing back
+	size_t total = size + alignment - ALIGNMENT;
+	if (total < size) return NULL;
+	int index = level(total);
+#if HEADERLESS
+	// Without heads, every block is aligned to its own size, so a block as large as the alignment needs no more room
+	int aligned = __builtin_ctzl(alignment) - MIN;
+	if (aligned <= MAX_LEVEL) index = level(size) > aligned ? level(size) : aligned;
+#endif // HEADERLESS
+	
+	char *memory;
+	if (index > MAX_LEVEL) {
+		BlockHead *large = newLargeBlock(total);
+		if (large == NULL) return NULL;
+		memory = (char*)hideLarge(large);
+	} else {
+		Heap *heap = getHeap();
+#if THREAD_SAFE == THREAD_HEAPS
+		if (heap == NULL) return NULL;
+		if (hasRemoteFrees(heap)) drainRemoteFrees(heap);
+#endif // THREAD_HEAPS
+		memory = (char*)takeBlock(heap, index, size);
+		if (memory == NULL) return NULL;
+	}
+	
+	char *result = (char*)(((long int)memory + alignment - 1) & ~(long int)(alignment - 1));
+	if (result != memory) {
+		BlockHead *head = (BlockHead*)(result - ALIGNMENT);
+		head->status = Aligned;
+		head->level = (level_t)((result - memory) / ALIGNMENT);
+	}
+	return result;
+}
+
+#if SLABS
+/// Give a slab object back to the heap owning its slab
+void releaseObject(void *object) {
+	Heap *heap = slabOf(object)->heap;
+#if THREAD_SAFE == THREAD_HEAPS
+	if (heap != localHeap) {
+		pushRemoteSlabFree(heap, object);
+		return;
+	}
+#endif // THREAD_HEAPS
+	lock_core();
+	slabFree(heap, object);
+	unlock_core();
+}
+#endif // SLABS
+
+/// Give a taken block back to its heap
+///
+/// The level in the head of the block has to be valid
+void release(FreeBlockHead *block) {
+#if THREAD_SAFE == MAGAZINES
+	if (block->header.level < MAGAZINE_LEVELS) {
+		magazines.freed_bytes += (size_t)1 << (block->header.level + MIN);
+		magazinePush(block);
+		return;
+	}
+#endif // MAGAZINES
+#if THREAD_SAFE == THREAD_HEAPS
+	Heap *heap = descriptor(block)->owner;
+	if (heap != localHeap) {
+		pushRemoteFree(heap, block);
+		return;
+	}
+#else
+	Heap *heap = &globalHeap;
+#endif // THREAD_HEAPS
+	lock_core();
+	add_counter(heap->freed_bytes, (size_t)1 << (block->header.level + MIN));
+	pushFreed(heap, block);
+	unlock_core();
+}
+
+static inline void deallocate(void *memory) {
+	if (memory != NULL) {
+#if SLABS || HEADERLESS
+		Superblock *superblock = descriptor(memory);
+#endif
+#if SLABS
+		if (superblock != NULL && superblock->slabs[((long int)memory & (SUPERBLOCK - 1)) / PAGE]) {
+			releaseObject(memory);
+			return;
+		}
+#endif // SLABS
+#if HEADERLESS
+		// Only the side table knows where the block is from and what its level is
+		if (superblock == NULL) {
+			BlockHead *large = unhideLarge(unalign(memory));
+			assert(large->status == Mapped);
+			releaseLarge(large);
+			return;
+		}
+		BlockHead *block = (BlockHead*)memory;
+		block->level = takenLevel(superblock, block);
+#else
+		BlockHead *block = unhideHead(unalign(memory));
+		if (block->status == Mapped) {
+			releaseLarge(block);
+			return;
+		}
+		assert(block->status == Taken);
+#endif // HEADERLESS
+		release((FreeBlockHead*)block);
+	}
+}
+
+#if LATENCY
+/// Raise the highest latency of a path to given number of cycles
+static inline void raiseLatency(latency_t *max, size_t cycles) {
+#if THREAD_SAFE == MAGAZINES
+	size_t old = read_shared(*max);
+	while (old < cycles && !atomic_compare_exchange_weak_explicit(max, &old, cycles, memory_order_relaxed, memory_order_relaxed));
+#else
+	size_t old = read_latency(*max);
+	if (old < cycles) add_latency(*max, cycles - old);
+#endif // MAGAZINES
+}
+
+/// Record the latency of a call that started at given cycle count
+///
+/// The call took the path of given group as deep as mark_path noted
+static void recordLatency(enum BuddyPath group, unsigned long long start) {
+	unsigned long long cycles = readCycles() - start;
+	int path = group + latencyDepth;
+	Heap *heap = getHeap();
+#if THREAD_SAFE == THREAD_HEAPS
+	if (heap == NULL) return;
+#endif // THREAD_HEAPS
+	add_latency(heap->latency[path][63 - __builtin_clzll(cycles | 1)], 1);
+	raiseLatency(&heap->latency_max[path], cycles);
+}
+#endif // LATENCY
+
+/// Allocate size bytes of memory
+void *balloc(size_t size) {
+#if LATENCY
+	unsigned long long start = readCycles();
+	latencyDepth = 0;
+	void *memory = allocate(size);
+	recordLatency(BPATH_ALLOC_HIT, start);
+	return memory;
+#else
+	return allocate(size);
+#endif // LATENCY
 }
 
 /// Free memory
 void bfree(void *memory) {
+#if LATENCY
+	unsigned long long start = readCycles();
+	latencyDepth = 0;
+	deallocate(memory);
+	recordLatency(BPATH_FREE_HIT, start);
+#else
+	deallocate(memory);
+#endif // LATENCY
+}
+
+/// Free memory of known size
+void bfree_sized(void *memory, size_t size) {
 	if (memory != NULL) {
+#if SLABS
+		if (size <= SLAB_MAX) {
+			releaseObject(memory);
+			return;
+		}
+#endif // SLABS
+		int index = level(size);
+		if (index > MAX_LEVEL) {
+			releaseLarge(unhideLarge(memory));
+			return;
+		}
+		BlockHead *block = unhideHead(memory);
+		assert(takenLevel(sideTable(block), block) == index);
+		block->level = index;
+		release((FreeBlockHead*)block);
+	}
+}
+
+static int compareAddresses(void const *first, void const *second) {
+	char const *a = *(char const * const *)first;
+	char const *b = *(char const * const *)second;
+	return (a > b) - (a < b);
+}
+
+/// Sort addresses in ascending order
+///
+/// Batches are mostly freed in the order balloc_batch handed them out, which insertion sort passes in linear time
+static inline void sortAddresses(void **memory, size_t count) {
+	if (count > SORT_INSERTION) {
+		qsort(memory, count, sizeof(void*), &compareAddresses);
+		return;
+	}
+	for (size_t i = 1; i < count; ++i) {
+		void *address = memory[i];
+		size_t j = i;
+		for (; j > 0 && (char*)memory[j - 1] > (char*)address; --j) memory[j] = memory[j - 1];
+		memory[j] = address;
+	}
+}
+
+/// Free given number of memory at once
+///
+/// Blocks of the local heap are sorted by address, so buddies freed together end up next to each other
+/// and merge in a single pass, before the merged blocks are inserted one by one.
+/// The merging works like a stack, the top block merges with the one below it as long as they are buddies.
+void bfree_batch(void **memory, size_t count) {
+	Heap *heap = getHeap();
+#if THREAD_SAFE == THREAD_HEAPS
+	// A thread without a heap of its own gives every block back to its owner on its own
+	if (heap == NULL) {
+		for (size_t i = 0; i < count; ++i) bfree(memory[i]);
+		return;
+	}
+#endif // THREAD_HEAPS
+	size_t blocks = 0;
+	size_t freed = 0;
+	for (size_t i = 0; i < count; ++i) {
+		void *address = memory[i];
+		if (address == NULL) continue;
+#if SLABS || HEADERLESS || THREAD_SAFE == THREAD_HEAPS
+		Superblock *superblock = descriptor(address);
+#endif
+#if SLABS
+		if (isObject(superblock, address)) {
+			releaseObject(address);
+			continue;
+		}
+#endif // SLABS
+		// Large and aligned memory is freed on its own
+#if HEADERLESS
+		if (superblock == NULL) {
+			bfree(address);
+			continue;
+		}
+		BlockHead *block = (BlockHead*)address;
+		block->level = takenLevel(superblock, block);
+#else
+		BlockHead *block = unhideHead(address);
+		if (block->status != Taken) {
+			bfree(address);
+			continue;
+		}
+#endif // HEADERLESS
+#if THREAD_SAFE == THREAD_HEAPS
+		if (superblock->owner != heap) {
+			release((FreeBlockHead*)block);
+			continue;
+		}
+#endif // THREAD_HEAPS
+		memory[blocks++] = block;
+		freed += (size_t)1 << (block->level + MIN);
+	}
+	sortAddresses(memory, blocks);
+	
+	size_t top = 0;
+	size_t merges = 0;
+	for (size_t i = 0; i < blocks; ++i) {
+		BlockHead *block = (BlockHead*)memory[i];
+		while (top > 0) {
+			BlockHead *below = (BlockHead*)memory[top - 1];
+			if (block->level != below->level || block->level == MAX_LEVEL || buddy(below) != block) break;
+			below->level++;
+			block = below;
+			top--;
+			merges++;
+		}
+		memory[top++] = block;
+	}
+	
+	lock_core();
+	add_counter(heap->freed_bytes, freed);
+	add_counter(heap->merges, merges);
+	for (size_t i = 0; i < top; ++i) {
+		FreeBlockHead *block = (FreeBlockHead*)memory[i];
+		block->next = block->prev = NULL;
+		insert(heap, block, 0);
+	}
+	unlock_core();
+}
+
+/// Resize memory, keeping its content
+void *brealloc(void *memory, size_t size) {
+	if (memory == NULL) return balloc(size);
+	if (size == 0) {
+		bfree(memory);
+		return NULL;
+	}
+	
+	size_t usable = bsize(memory);
+	int index = level(size);
+	Superblock *superblock = descriptor(memory);
+	BlockHead *large;
+	if (isObject(superblock, memory)) {
+		if (size <= usable) return memory;
+	} else if (isAligned(superblock, memory)) {
+		// Aligned memory doesn't start its block, it always moves (without keeping its alignment)
+	} else if ((large = largeHead(superblock, memory)) != NULL) {
+		// The kernel moves the pages of a large block, there is nothing to copy
+		if (index > MAX_LEVEL) {
+			size_t pages = largePages(size);
+			if (pages == 0 || pages > INT_MAX) return NULL;
+			size_t old = (size_t) large->level;
+			BlockHead *new = (BlockHead*) mremap(large, old * PAGE, pages * PAGE, MREMAP_MAYMOVE);
+			if (new == MAP_FAILED) return NULL;
+			new->level = (level_t) pages;
+			// Counted as a free followed by a new allocation
+			add_shared(mappings.mapped_pages, pages - old);
+			if (pages < old) add_shared(mappings.returned_pages, old - pages);
+			add_shared(mappings.freed_bytes, old * PAGE);
+			add_shared(mappings.requested_bytes, size);
+			add_shared(mappings.allocated_bytes, pages * PAGE);
+			return hideLarge(new);
+		}
+	} else if (index <= MAX_LEVEL && (!SLABS || size > SLAB_MAX)) {
+		// A block shrunk to the size of a slab object moves into one, bfree_sized takes anything that size for an object
 		BlockHead *block = unhideHead(memory);
-		assert(block->status = Taken);
-		FreeBlockHead *freeBlock = (FreeBlockHead*)block;
-		// used to be user data, so we clean this
-		freeBlock->next = freeBlock->prev = NULL;
-		insert(freeBlock);
+		Heap *heap = superblock->owner;
+#if THREAD_SAFE == THREAD_HEAPS
+		// Only the owner may touch the free lists of a heap
+		if (heap != localHeap) heap = NULL;
+#endif // THREAD_HEAPS
+		if (heap != NULL) {
+			lock_core();
+			int resized = resize(heap, block, index);
+			if (resized) {
+				add_counter(heap->freed_bytes, usable + HEAD_SIZE);
+				countRequest(heap, size, (size_t)1 << (index + MIN));
+			}
+			unlock_core();
+			if (resized) return memory;
+		}
+	}
+	
+	// Neither the block nor its buddies have room, so the content has to move
+	void *new = balloc(size);
+	if (new == NULL) return NULL;
+	memcpy(new, memory, usable < size ? usable : size);
+	bfree(memory);
+	return new;
+}
+
+/// Number of bytes usable at given memory
+size_t bsize(void *memory) {
+	if (memory == NULL) return 0;
+#if SLABS || HEADERLESS
+	Superblock *superblock = descriptor(memory);
+#endif
+#if SLABS
+	if (superblock != NULL && superblock->slabs[((long int)memory & (SUPERBLOCK - 1)) / PAGE]) {
+		return SLAB_SIZES[slabOf(memory)->sizeClass];
+	}
+#endif // SLABS
+#if HEADERLESS
+	if (superblock == NULL) {
+		char *base = (char*)unalign(memory);
+		return (size_t)unhideLarge(base)->level * PAGE - ALIGNMENT - ((char*)memory - base);
+	}
+	return ((size_t)1 << (takenLevel(superblock, (BlockHead*)memory) + MIN));
+#else
+	char *base = (char*)unalign(memory);
+	BlockHead *block = unhideHead(base);
+	size_t usable = block->status == Mapped ? (size_t)block->level * PAGE - ALIGNMENT : ((size_t)1 << (block->level + MIN)) - HEAD_SIZE;
+	return usable - ((char*)memory - base);
+#endif // HEADERLESS
+}
+
+/// Release free memory to OS
+size_t btrim() {
+	size_t released = 0;
+	Heap *heap = getHeap();
+#if THREAD_SAFE == THREAD_HEAPS
+	if (heap == NULL) return 0;
+	drainRemoteFrees(heap);
+#endif // THREAD_HEAPS
+	
+	lock_core();
+#if LAZY
+	// Blocks waiting unmerged might complete pages and superblocks
+	flushQuick(heap);
+#endif // LAZY
+#if SLABS
+	// Empty slabs kept for reuse give their pages back first, so they can coalesce
+	for (int sizeClass = 0; sizeClass < SLAB_CLASSES; ++sizeClass) {
+		Slab *slab = heap->slabs[sizeClass];
+		while (slab != NULL) {
+			Slab *next = slab->next;
+			if (slab->used == 0) releaseSlab(heap, slab);
+			slab = next;
+		}
+	}
+#endif // SLABS
+	
+	// Cached superblocks are given back altogether, cold ones only had their first page left
+	released += trimCache(heap, 0);
+	while (heap->coldSuperblocks != NULL) {
+		FreeBlockHead *block = heap->coldSuperblocks;
+		heap->coldSuperblocks = block->next;
+		releaseSuperblock(block);
+		released += PAGE;
+	}
+	heap->num_of_cold_superblocks = 0;
+	
+	// Free runs of pages inside of used superblocks keep only their first page
+	// Runs decommitted before are skipped, they are only counted once
+	for (level_t level = PAGE_LEVEL + 1; level < MAX_LEVEL; ++level) {
+		size_t size = 1L << (level + MIN);
+		for (FreeBlockHead *block = heap->freeBlocks[level]; block != NULL; block = block->next) {
+			if (block->decommitted) continue;
+			decommit(block, size, MADV_DONTNEED);
+			block->decommitted = 1;
+			add_counter(heap->decommitted_bytes, size - PAGE);
+			released += size - PAGE;
+			add_shared(mappings.returned_pages, size / PAGE - 1);
+		}
+	}
+	
+	heap->superblock_peak = heap->window_peak = heap->num_of_used_superblocks;
+	heap->returned_superblocks = 0;
+	unlock_core();
+	return released;
+}
+
+/// Create an independent heap
+bheap_t *bheap_create(size_t budget) {
+	Heap *heap = (Heap*) mmap(NULL, sizeof(Heap), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (heap == MAP_FAILED) return NULL;
+	heap->budget = budget;
+	return heap;
+}
+
+/// Record a large allocation in the list of its heap
+///
+/// The list grows by doubling its mapping, returns 0 if it can't
+static int addLarge(Heap *heap, LargeHead *large) {
+	if (heap->num_of_large == heap->large_capacity) {
+		size_t capacity = heap->large_capacity ? 2 * heap->large_capacity : PAGE / sizeof(LargeHead*);
+		LargeHead **list = heap->large == NULL
+			? (LargeHead**) mmap(NULL, capacity * sizeof(LargeHead*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+			: (LargeHead**) mremap(heap->large, heap->large_capacity * sizeof(LargeHead*), capacity * sizeof(LargeHead*), MREMAP_MAYMOVE);
+		if (list == MAP_FAILED) return 0;
+		heap->large = list;
+		heap->large_capacity = capacity;
+	}
+	large->slot = (unsigned int) heap->num_of_large;
+	heap->large[heap->num_of_large++] = large;
+	return 1;
+}
+
+/// Unmap all large allocations of a heap
+static void dropLarge(Heap *heap) {
+	for (size_t i = 0; i < heap->num_of_large; ++i) {
+		heap->mapped_bytes -= (size_t) heap->large[i]->header.level * PAGE;
+		releaseLarge(&heap->large[i]->header);
+	}
+	heap->num_of_large = 0;
+}
+
+/// Allocate size bytes of memory from given heap
+void *bheap_alloc(bheap_t *heap, size_t size) {
+	if (size == 0) return NULL;
+	
+	int index = level(size);
+	if (index > MAX_LEVEL) {
+		size_t pages = largePages(size);
+		if (heap->budget != 0 && heap->mapped_bytes + pages * PAGE > heap->budget) return NULL;
+		LargeHead *large = (LargeHead*) newLargeBlock(size);
+		if (large == NULL) return NULL;
+		if (!addLarge(heap, large)) {
+			releaseLarge(&large->header);
+			return NULL;
+		}
+		heap->mapped_bytes += pages * PAGE;
+		return hideLarge(&large->header);
+	}
+#if SLABS
+	if (size <= SLAB_MAX) return slabAlloc(heap, size);
+#endif // SLABS
+	BlockHead *block = (BlockHead*)find(heap, index);
+	if (block == NULL) return NULL;
+	setStatus(sideTable(block), block, Taken);
+	countRequest(heap, size, (size_t)1 << (index + MIN));
+	return hideHead(block);
+}
+
+/// Free memory allocated from given heap
+void bheap_free(bheap_t *heap, void *memory) {
+	if (memory == NULL) return;
+	
+	Superblock *superblock = descriptor(memory);
+	if (superblock == NULL) {
+		// Large allocations are the only memory outside of superblocks, the last one takes the place of the freed one
+		LargeHead *large = (LargeHead*) unhideLarge(memory);
+		assert(large->header.status == Mapped && heap->large[large->slot] == large);
+		LargeHead *last = heap->large[--heap->num_of_large];
+		heap->large[large->slot] = last;
+		last->slot = large->slot;
+		heap->mapped_bytes -= (size_t) large->header.level * PAGE;
+		releaseLarge(&large->header);
+		return;
+	}
+	assert(superblock->owner == heap);
+#if SLABS
+	if (isObject(superblock, memory)) {
+		slabFree(heap, memory);
+		return;
+	}
+#endif // SLABS
+	FreeBlockHead *block = (FreeBlockHead*) unhideHead(memory);
+	block->header.level = takenLevel(superblock, &block->header);
+	add_counter(heap->freed_bytes, (size_t)1 << (block->header.level + MIN));
+	pushFreed(heap, block);
+}
+
+/// Drop every allocation of given heap at once
+///
+/// Large allocations are unmapped, every superblock becomes a single free block again and stays for reuse,
+/// so the cost depends on the number of superblocks, not on the number of allocations
+/// Superblocks that were cold (or free and never touched) stay decommitted in the cold list
+void bheap_reset(bheap_t *heap) {
+	dropLarge(heap);
+	
+	for (level_t level = 0; level < LEVELS; ++level) {
+		heap->freeBlocks[level] = NULL;
+		heap->free_blocks[level] = 0;
+	}
+	heap->freeLevels = 0;
+	heap->decommitted_bytes = 0;
+#if LAZY
+	for (level_t level = 0; level < QUICK_LEVELS; ++level) {
+		heap->quickBlocks[level] = NULL;
+		heap->quick_blocks[level] = 0;
+	}
+	heap->quick_bytes = 0;
+#endif // LAZY
+#if SLABS
+	for (int sizeClass = 0; sizeClass < SLAB_CLASSES; ++sizeClass) {
+		heap->slabs[sizeClass] = NULL;
+		heap->slab_objects[sizeClass] = 0;
+	}
+#endif // SLABS
+	heap->coldSuperblocks = NULL;
+	heap->num_of_cold_superblocks = 0;
+	heap->num_of_free_superblocks = 0;
+	heap->num_of_used_superblocks = 0;
+	// Nothing is in use, so demand from before the reset doesn't say how much to keep
+	heap->superblock_peak = heap->window_peak = 0;
+	heap->returned_superblocks = 0;
+	
+	for (Superblock *superblock = heap->owned; superblock != NULL; superblock = superblock->next) {
+		FreeBlockHead *block = (FreeBlockHead*) superblock->memory;
+		// A free superblock given back before (or never touched) is cold again, a used one may have any page resident
+		int cold = isFree(superblock, &block->header, MAX_LEVEL) && block->decommitted;
+#if SLABS
+		memset(superblock->slabs, 0, sizeof(superblock->slabs));
+#endif // SLABS
+#if COMPACT
+		superblock->freeBytes = 0;
+		memset(superblock->pageFree, 0, sizeof(superblock->pageFree));
+#endif // COMPACT
+		// Stale side table entries inside of the superblock are never consulted, a buddy always starts a block
+		block->header.level = MAX_LEVEL;
+		setStatus(superblock, &block->header, Free);
+		block->decommitted = cold;
+		block->prev = NULL;
+		if (cold) {
+			block->next = heap->coldSuperblocks;
+			heap->coldSuperblocks = block;
+			heap->num_of_cold_superblocks++;
+			continue;
+		}
+		block->next = heap->freeBlocks[MAX_LEVEL];
+		if (block->next) block->next->prev = block;
+		heap->freeBlocks[MAX_LEVEL] = block;
+		heap->num_of_free_superblocks++;
+	}
+	if (heap->num_of_free_superblocks != 0) mark_level(heap, MAX_LEVEL);
+	heap->free_blocks[MAX_LEVEL] = heap->num_of_free_superblocks;
+	heap->cached_pages = heap->num_of_free_superblocks * SUPERBLOCK_PAGES;
+	// Whatever was still allocated counts as freed
+	heap->freed_bytes = read_counter(heap->allocated_bytes);
+}
+
+/// Destroy given heap, giving all of its memory back to OS
+void bheap_destroy(bheap_t *heap) {
+	dropLarge(heap);
+	if (heap->large != NULL) munmap(heap->large, heap->large_capacity * sizeof(LargeHead*));
+	while (heap->owned != NULL) releaseSuperblock((FreeBlockHead*) heap->owned->memory);
+#if HUGE_PAGES
+	if (heap->spareSuperblock != NULL) munmap(heap->spareSuperblock, SUPERBLOCK);
+#endif // HUGE_PAGES
+	munmap(heap, sizeof(Heap));
+}
+
+/// Add the statistics of a heap to given totals
+static void sumStats(Heap *heap, BuddyStats *stats) {
+	for (level_t level = 0; level < LEVELS; ++level) {
+		size_t blocks = read_counter(heap->free_blocks[level]);
+		stats->freeBlocks[level] += blocks;
+		stats->freeBytes[level] += blocks << (level + MIN);
+	}
+#if LAZY
+	// Blocks waiting unmerged are free all the same
+	for (level_t level = 0; level < QUICK_LEVELS; ++level) {
+		size_t blocks = read_counter(heap->quick_blocks[level]);
+		stats->freeBlocks[level] += blocks;
+		stats->freeBytes[level] += blocks << (level + MIN);
+	}
+#endif // LAZY
+#if SLABS
+	for (int sizeClass = 0; sizeClass < SLAB_CLASSES; ++sizeClass) {
+		stats->slabObjects[sizeClass] += read_counter(heap->slab_objects[sizeClass]);
+	}
+#endif // SLABS
+	stats->pagesCached += read_counter(heap->cached_pages);
+	stats->bytesDecommitted += read_counter(heap->decommitted_bytes);
+	stats->bytesRequested += read_counter(heap->requested_bytes);
+	stats->bytesAllocated += read_counter(heap->allocated_bytes);
+	stats->bytesFreed += read_counter(heap->freed_bytes);
+	stats->splits += read_counter(heap->splits);
+	stats->merges += read_counter(heap->merges);
+}
+
+/// Collect the statistics of all heaps
+BuddyStats bstats() {
+	BuddyStats stats;
+	memset(&stats, 0, sizeof(stats));
+#if THREAD_SAFE == THREAD_HEAPS
+	pthread_mutex_lock(&heapsLock);
+	for (Heap *heap = allHeaps; heap != NULL; heap = heap->nextHeap) sumStats(heap, &stats);
+	pthread_mutex_unlock(&heapsLock);
+#else
+	lock_core();
+#if THREAD_SAFE == MAGAZINES
+	// Other threads add theirs with their next refill or flush
+	flushCounters(&magazines);
+#endif // MAGAZINES
+	sumStats(&globalHeap, &stats);
+	unlock_core();
+#endif // THREAD_HEAPS
+	
+	stats.pagesMapped = read_shared(mappings.mapped_pages);
+	stats.pagesReturned = read_shared(mappings.returned_pages);
+	stats.bytesRequested += read_shared(mappings.requested_bytes);
+	stats.bytesAllocated += read_shared(mappings.allocated_bytes);
+	stats.bytesFreed += read_shared(mappings.freed_bytes);
+	return stats;
+}
+
+static void printArray(FILE *file, char const *name, size_t const *values, int count) {
+	fprintf(file, "\"%s\": [", name);
+	for (int i = 0; i < count; ++i) fprintf(file, i ? ", %zu" : "%zu", values[i]);
+	fprintf(file, "]");
+}
+
+/// Print statistics as text or as a single JSON object
+void bstats_print(FILE *file, BuddyStats const *stats, int json) {
+	if (json) {
+		fprintf(file, "{\"bytesRequested\": %zu, \"bytesAllocated\": %zu, \"bytesFreed\": %zu, ",
+			stats->bytesRequested, stats->bytesAllocated, stats->bytesFreed);
+		fprintf(file, "\"splits\": %zu, \"merges\": %zu, ", stats->splits, stats->merges);
+		fprintf(file, "\"pagesMapped\": %zu, \"pagesCached\": %zu, \"pagesReturned\": %zu, \"bytesDecommitted\": %zu, ",
+			stats->pagesMapped, stats->pagesCached, stats->pagesReturned, stats->bytesDecommitted);
+		printArray(file, "freeBlocks", stats->freeBlocks, BSTATS_LEVELS);
+		fprintf(file, ", ");
+		printArray(file, "freeBytes", stats->freeBytes, BSTATS_LEVELS);
+		fprintf(file, ", ");
+		printArray(file, "slabObjects", stats->slabObjects, BSTATS_CLASSES);
+		fprintf(file, "}\n");
+		return;
+	}
+	
+	double wasted = stats->bytesAllocated ? 100.0 * (stats->bytesAllocated - stats->bytesRequested) / stats->bytesAllocated : 0.0;
+	fprintf(file, "bytes requested  %zu\n", stats->bytesRequested);
+	fprintf(file, "bytes allocated  %zu (%.1f%% internal fragmentation)\n", stats->bytesAllocated, wasted);
+	fprintf(file, "bytes freed      %zu\n", stats->bytesFreed);
+	fprintf(file, "splits / merges  %zu / %zu\n", stats->splits, stats->merges);
+	fprintf(file, "pages mapped     %zu (%zu of them cached)\n", stats->pagesMapped, stats->pagesCached);
+	fprintf(file, "pages returned   %zu (%zu bytes of free blocks not resident)\n", stats->pagesReturned, stats->bytesDecommitted);
+	for (level_t level = 0; level < LEVELS; ++level) {
+		if (stats->freeBlocks[level] == 0) continue;
+		fprintf(file, "level %2d (%7ld bytes): %zu free blocks, %zu bytes\n", level, 1L << (level + MIN), stats->freeBlocks[level], stats->freeBytes[level]);
+	}
+#if SLABS
+	for (int sizeClass = 0; sizeClass < SLAB_CLASSES; ++sizeClass) {
+		if (stats->slabObjects[sizeClass] == 0) continue;
+		fprintf(file, "slab class %3d bytes: %zu objects in use\n", SLAB_SIZES[sizeClass], stats->slabObjects[sizeClass]);
+	}
+#endif // SLABS
+}
+
+/// Prints states of free lists
+///
+/// Walks the lists of the heap of the calling thread and checks them against its counters
+void printFreeLists() {
+	Heap *heap = getHeap();
+#if THREAD_SAFE == THREAD_HEAPS
+	if (heap == NULL) return;
+#endif // THREAD_HEAPS
+	lock_core();
+	for (level_t level = 0; level < LEVELS; ++level) {
+		size_t blocks = 0;
+		for (FreeBlockHead *block = heap->freeBlocks[level]; block != NULL; block = block->next) {
+			assert(isFree(sideTable(block), &block->header, level));
+			blocks++;
+		}
+		assert(blocks == read_counter(heap->free_blocks[level]));
+		assert((blocks != 0) == ((heap->freeLevels >> level) & 0x1u));
+		
+		printf("level %2d (%7ld bytes): %zu", level, 1L << (level + MIN), blocks);
+		int shown = 0;
+		for (FreeBlockHead *block = heap->freeBlocks[level]; block != NULL && shown < 4; block = block->next, ++shown) {
+			printf(shown ? " %p" : " at %p", (void*)block);
+		}
+		printf(blocks > 4 ? " ...\n" : "\n");
+	}
+#if LAZY
+	for (level_t level = 0; level < QUICK_LEVELS; ++level) {
+		size_t blocks = 0;
+		for (FreeBlockHead *block = heap->quickBlocks[level]; block != NULL; block = block->next) {
+			assert(block->header.level == level && !isFree(sideTable(block), &block->header, level));
+			blocks++;
+		}
+		assert(blocks == read_counter(heap->quick_blocks[level]));
+		if (blocks) printf("level %2d (%7ld bytes): %zu waiting unmerged\n", level, 1L << (level + MIN), blocks);
+	}
+#endif // LAZY
+	unlock_core();
+}
+
+/// Test the buddy allocation algorithm
+///
+/// Allocates and frees a couple of blocks of every kind, printing the free lists after every step
+void verboseTest() {
+	static size_t const sizes[] = {1, 100, 200, 1000, PAGE, 5000, 70000, 2 * SUPERBLOCK};
+	size_t const count = sizeof(sizes) / sizeof(sizes[0]);
+	void *memory[sizeof(sizes) / sizeof(sizes[0])];
+	size_t requested = 0;
+	BuddyStats before = bstats();
+	
+	for (size_t i = 0; i < count; ++i) {
+		memory[i] = balloc(sizes[i]);
+		requested += sizes[i];
+		assert(memory[i] != NULL);
+		assert(((long int)memory[i] & (sizes[i] < ALIGNMENT ? 7 : ALIGNMENT - 1)) == 0);
+		assert(bsize(memory[i]) >= sizes[i]);
+		memset(memory[i], 0xAB, sizes[i]);
+		printf("balloc(%zu) = %p, %zu bytes usable\n", sizes[i], memory[i], bsize(memory[i]));
+		printFreeLists();
+	}
+	for (size_t i = 0; i < count; ++i) {
+		bfree(memory[i]);
+		printf("bfree(%p)\n", memory[i]);
+		printFreeLists();
+	}
+	
+	BuddyStats after = bstats();
+	assert(after.bytesAllocated - before.bytesAllocated == after.bytesFreed - before.bytesFreed);
+	assert(after.bytesRequested - before.bytesRequested == requested);
+	bstats_print(stdout, &after, 0);
+}
+
+#if LATENCY
+/// Add the histogram of a path of a heap to given buckets
+static void sumLatency(Heap *heap, enum BuddyPath path, size_t *buckets, unsigned long long *max) {
+	for (int bucket = 0; bucket < BLATENCY_BUCKETS; ++bucket) buckets[bucket] += read_latency(heap->latency[path][bucket]);
+	size_t highest = read_latency(heap->latency_max[path]);
+	if (highest > *max) *max = highest;
+}
+#endif // LATENCY
+
+/// Summarize the latencies of a path
+///
+/// Percentiles are the upper bounds of their buckets, so they are within a factor of 2
+BuddyLatency blatency(enum BuddyPath path) {
+	BuddyLatency latency;
+	memset(&latency, 0, sizeof(latency));
+#if LATENCY
+	size_t buckets[BLATENCY_BUCKETS] = {0};
+#if THREAD_SAFE == THREAD_HEAPS
+	pthread_mutex_lock(&heapsLock);
+	for (Heap *heap = allHeaps; heap != NULL; heap = heap->nextHeap) sumLatency(heap, path, buckets, &latency.max);
+	pthread_mutex_unlock(&heapsLock);
+#else
+	sumLatency(&globalHeap, path, buckets, &latency.max);
+#endif // THREAD_HEAPS
+	
+	for (int bucket = 0; bucket < BLATENCY_BUCKETS; ++bucket) latency.count += buckets[bucket];
+	size_t seen = 0;
+	for (int bucket = 0; bucket < BLATENCY_BUCKETS && latency.p99 == 0; ++bucket) {
+		seen += buckets[bucket];
+		unsigned long long bound = (2ULL << bucket) - 1;
+		if (bound > latency.max) bound = latency.max;
+		if (latency.p50 == 0 && seen * 2 >= latency.count && seen != 0) latency.p50 = bound;
+		if (seen * 100 >= latency.count * 99 && seen != 0) latency.p99 = bound;
+	}
+#else
+	(void) path;
+#endif // LATENCY
+	return latency;
+}
+
+/// Print the latencies of all paths as a table, or as a single line JSON object if json is set
+void blatency_print(FILE *file, int json) {
+	static char const * const NAMES[BPATHS] = {"alloc hit", "alloc split", "alloc map", "free hit", "free merge", "free unmap"};
+	static char const * const KEYS[BPATHS] = {"allocHit", "allocSplit", "allocMap", "freeHit", "freeMerge", "freeUnmap"};
+	
+	if (!json) {
+		if (!LATENCY) fprintf(file, "latencies are only recorded when built with -DLATENCY=1\n");
+		fprintf(file, "path        ||      calls ||    p50    ||    p99    ||    max     (cycles)\n");
+	}
+	for (int path = 0; path < BPATHS; ++path) {
+		BuddyLatency latency = blatency((enum BuddyPath) path);
+		if (json) {
+			fprintf(file, "%s\"%s\": {\"count\": %zu, \"p50\": %llu, \"p99\": %llu, \"max\": %llu}",
+				path ? ", " : "{", KEYS[path], latency.count, latency.p50, latency.p99, latency.max);
+		} else {
+			fprintf(file, "%-11s || %10zu || %9llu || %9llu || %10llu\n", NAMES[path], latency.count, latency.p50, latency.p99, latency.max);
+		}
 	}
+	if (json) fprintf(file, "}\n");
 }
@@ -1,18 +1,168 @@
 #include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BSTATS_LEVELS		16	// levels of the buddy tree, a block of level i spans 32 << i bytes
+#define BSTATS_CLASSES		8	// size classes of slab objects
+#define BPAGE				4096	// blocks of a page and larger are aligned to it
+#define BSUPERBLOCK			(32L << (BSTATS_LEVELS - 1))	// the largest block, larger requests get a fresh (zeroed) mapping
+
+/// Statistics of the allocator
+///
+/// Byte and split counts add up since the start of the program, the rest describes the current state
+/// Blocks and objects count in full, so allocated bytes over requested bytes is the internal fragmentation
+typedef struct BuddyStats {
+	size_t	freeBlocks[BSTATS_LEVELS];		// blocks in the free lists of every level
+	size_t	freeBytes[BSTATS_LEVELS];
+	size_t	slabObjects[BSTATS_CLASSES];	// objects in use per slab size class
+	size_t	pagesMapped;					// pages of superblocks, their descriptors and large allocations
+	size_t	pagesCached;					// pages of free superblocks kept for reuse
+	size_t	pagesReturned;					// pages unmapped or decommitted
+	size_t	bytesDecommitted;				// of the free blocks, not resident (given back by btrim or never touched)
+	size_t	bytesRequested;					// sizes given to balloc and friends
+	size_t	bytesAllocated;					// sizes of the blocks handed out for them
+	size_t	bytesFreed;
+	size_t	splits;
+	size_t	merges;
+} BuddyStats;
+
+#define BLATENCY_BUCKETS	64	// a bucket per power of 2 of cycles
+
+/// Paths balloc and bfree take, timed when built with -DLATENCY=1
+///
+/// A call counts for the deepest path it went down
+enum BuddyPath {
+	BPATH_ALLOC_HIT,		// a block or object was at hand
+	BPATH_ALLOC_SPLIT,		// a larger block was split
+	BPATH_ALLOC_MAP,		// memory was mapped from OS
+	BPATH_FREE_HIT,			// the block went back without merging
+	BPATH_FREE_MERGE,		// the block merged with its buddies
+	BPATH_FREE_UNMAP,		// memory was unmapped or decommitted
+	BPATHS
+};
+
+/// Latencies of a path, in ticks of a cycle counter
+typedef struct BuddyLatency {
+	size_t				count;
+	unsigned long long	p50;
+	unsigned long long	p99;
+	unsigned long long	max;
+} BuddyLatency;
+
+/// An independent buddy heap
+///
+/// balloc and friends use the default heap (or a heap per thread, with THREAD_SAFE=2)
+typedef struct Heap bheap_t;
 
 /// Test the buddy allocation algorithm
 void verboseTest();
 
 /// Prints states of free lists
+///
+/// Only the lists of the heap of the calling thread
 void printFreeLists();
 
+/// Collect statistics of the allocator
+///
+/// The counters are always kept, reading them is a walk over all heaps
+/// With magazines (THREAD_SAFE=1) requests served by other threads show once their magazines go back to the core
+BuddyStats bstats();
+
+/// Print statistics as text, or as a single line JSON object if json is set
+void bstats_print(FILE *file, BuddyStats const *stats, int json);
+
+/// Summarize the latencies of given path
+///
+/// All zero unless built with -DLATENCY=1, percentiles are only accurate to a power of 2
+BuddyLatency blatency(enum BuddyPath path);
+
+/// Print the latencies of all paths as a table, or as a single line JSON object if json is set
+void blatency_print(FILE *file, int json);
+
 /// Allocate size bytes
 ///
-/// Allocates size bytes of memory and returns the address of allocated memory
+/// Allocates size bytes of memory and returns the address of allocated memory, aligned to 16 bytes
+/// (requests of up to 8 bytes only to 8 bytes, nothing that needs more fits them)
 /// Uses custom Buddy algorithm to manage the memory and avoid unnecessary kernel traps
 void *balloc(size_t size);
 
+/// Allocate size bytes aligned to given power of 2
+///
+/// Blocks are aligned to their own size, so without heads (HEADERLESS) the alignment costs nothing but a large enough level
+/// With heads, the block grows by the alignment to keep its head in front of the aligned memory
+/// Alignments of up to 16 bytes are what balloc gives anyway, once the size is at least the alignment
+/// Returns NULL if the alignment is not a power of 2
+void *balloc_aligned(size_t size, size_t alignment);
+
+/// Allocate count blocks of size bytes at once
+///
+/// Fills memory with the addresses, splitting a single larger block for all of them where it can
+/// Returns the number of addresses filled in, less than count only if there is not enough memory
+size_t balloc_batch(size_t size, size_t count, void **memory);
+
 /// Free memory used by given address
 ///
 /// Frees up memory using Buddy algorithm, allowing reusing said memory
 void bfree(void *memory);
+
+/// Free memory of known size
+///
+/// Same as bfree, but the size given to balloc for this memory spares looking up its block level
+/// Not for memory from balloc_aligned
+void bfree_sized(void *memory, size_t size);
+
+/// Free count addresses at once
+///
+/// Buddies freed together are merged before they go back, instead of one merge chain per address
+/// The content of the memory array is overwritten
+void bfree_batch(void **memory, size_t count);
+
+/// Resize memory allocated by balloc
+///
+/// Grows a block by merging it with its free buddies and shrinks it by splitting off its upper halves,
+/// the content is only copied when neither is possible
+/// Returns the (possibly moved) memory or NULL if there is not enough memory, given memory stays valid then
+void *brealloc(void *memory, size_t size);
+
+/// Get the number of bytes usable at given address
+///
+/// At least the size given to balloc for this memory, the rest of its block is usable too
+size_t bsize(void *memory);
+
+/// Release free memory to OS
+///
+/// Unmaps all cached superblocks and decommits free runs of pages inside of used ones
+/// Returns the number of bytes unmapped or decommitted
+size_t btrim();
+
+/// Create an independent heap
+///
+/// The heap never maps more than budget bytes (rounded to superblocks of 1MB and pages), 0 for no limit
+/// A heap is not thread safe, only one thread may use it at a time
+/// Returns NULL if the heap can't be mapped
+bheap_t *bheap_create(size_t budget);
+
+/// Allocate size bytes from given heap
+///
+/// Returns NULL if there is not enough memory or the budget of the heap would be exceeded
+void *bheap_alloc(bheap_t *heap, size_t size);
+
+/// Free memory allocated from given heap
+///
+/// Memory of a heap may only go back through bheap_free (or bheap_reset), never through bfree
+void bheap_free(bheap_t *heap, void *memory);
+
+/// Drop every allocation of given heap at once
+///
+/// The memory of the heap stays mapped for the next allocations
+void bheap_reset(bheap_t *heap);
+
+/// Destroy given heap, unmapping all of its memory
+void bheap_destroy(bheap_t *heap);
+
+#ifdef __cplusplus
+}
+#endif
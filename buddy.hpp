@@ -0,0 +1,456 @@
+#include "buddy.h"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+#include <sys/mman.h>
+
+// Buddy heap with its geometry fixed at compile time
+//
+// Header only, needs C++17:
+// g++ -O2 -std=c++17 <your code>.cpp
+//
+// buddy.c fixes MIN, LEVELS and PAGE by #define, so a binary gets one geometry.
+// Every instantiation of BuddyHeap gets its own, with the mask math folded into its fast paths.
+//
+// BuddyResource, BuddyHeapResource and BuddyAllocator put standard containers on balloc and bheap_t,
+// those need buddy.c linked in.
+
+
+/// Mask math of a buddy tree of blocks of (1 << MinShift) << level bytes, for levels below Levels
+///
+/// Everything is constexpr, so it folds into the fast paths of every geometry
+template <unsigned MinShift, unsigned Levels>
+struct BuddyGeometry {
+	static constexpr size_t GRANULE = size_t(1) << MinShift;
+	static constexpr int MAX_LEVEL = int(Levels) - 1;
+	static constexpr size_t SUPERBLOCK = GRANULE << MAX_LEVEL;
+	
+	static_assert(MinShift >= 5, "a granule holds a free block and has to tell large memory apart");
+	static_assert(Levels >= 5 && Levels <= 32, "levels have to fit a bitmask of free lists");
+	static_assert(MinShift + Levels - 1 < sizeof(size_t) * 8, "a superblock has to be addressable");
+	
+	/// Size of a block of given level
+	static constexpr size_t blockSize(int level) {
+		return GRANULE << level;
+	}
+	
+	/// Level of the smallest block holding given size, a level above MAX_LEVEL if not even a superblock does
+	static constexpr int levelOf(size_t size) {
+		if (size <= GRANULE) return 0;
+		if (size > SUPERBLOCK) return MAX_LEVEL + 1;
+		return int(sizeof(unsigned long) * 8) - __builtin_clzl(size - 1) - int(MinShift);
+	}
+	
+	/// Find a buddy of a block of given level
+	///
+	/// This is done by flipping the bit that differentiates the two halves of their parent
+	static constexpr uintptr_t buddy(uintptr_t block, int level) {
+		return block ^ blockSize(level);
+	}
+	
+	/// Upper half of a block of given level, the lower half keeps the address of the block
+	static constexpr uintptr_t split(uintptr_t block, int level) {
+		return block | blockSize(level - 1);
+	}
+	
+	/// Primary (lower) one of two buddies of given level, which is where their merged block starts
+	static constexpr uintptr_t primary(uintptr_t block, int level) {
+		return block & ~(blockSize(level + 1) - 1);
+	}
+
+};
+
+/// Buddy heap of a given geometry
+///
+/// The block of the largest level is a superblock mapped from the OS, aligned to its own size.
+/// Blocks have no heads, a side table at the start of every superblock holds the status and level of every granule,
+/// so a power of 2 request fits its block exactly (the table itself takes the first block of the superblock).
+/// Requests of more than half a superblock (which the table leaves no room for) get a mapping of their own, rounded up to PageSize.
+/// A heap is not thread safe, only one thread may use it at a time.
+template <unsigned MinShift, unsigned Levels, size_t PageSize = 4096>
+class BuddyHeap : public BuddyGeometry<MinShift, Levels> {
+	using Geometry = BuddyGeometry<MinShift, Levels>;
+
+public:
+	using Geometry::GRANULE;
+	using Geometry::MAX_LEVEL;
+	using Geometry::SUPERBLOCK;
+	using Geometry::blockSize;
+	using Geometry::levelOf;
+	using Geometry::buddy;
+	using Geometry::split;
+	using Geometry::primary;
+	
+	static constexpr size_t ALIGNMENT = 16;
+	
+	static_assert((PageSize & (PageSize - 1)) == 0 && SUPERBLOCK % PageSize == 0, "superblocks consist of whole pages");
+	static_assert(Geometry::buddy(Geometry::split(0, MAX_LEVEL), MAX_LEVEL - 1) == 0, "halves of a block are buddies");
+	static_assert(Geometry::primary(Geometry::split(0, MAX_LEVEL), MAX_LEVEL - 1) == 0, "halves of a block merge back into it");
+	static_assert(Geometry::levelOf(GRANULE + 1) == 1 && Geometry::levelOf(SUPERBLOCK) == MAX_LEVEL, "levels double the granule");
+	
+	BuddyHeap() = default;
+	BuddyHeap(BuddyHeap const &) = delete;
+	BuddyHeap &operator=(BuddyHeap const &) = delete;
+	
+	/// Unmaps every superblock and large allocation, whether it was freed or not
+	~BuddyHeap() {
+		while (large != nullptr) {
+			Large *next = large->next;
+			munmap(large, large->pages * PageSize);
+			large = next;
+		}
+		while (superblocks != 0) {
+			uintptr_t next = nextSuperblock(superblocks);
+			munmap(reinterpret_cast<void*>(superblocks), SUPERBLOCK);
+			superblocks = next;
+		}
+	}
+	
+	/// Allocate size bytes, aligned to 16 bytes
+	///
+	/// Returns nullptr for size 0 or if there is not enough memory
+	void *allocate(size_t size) {
+		if (size == 0) return nullptr;
+		int level = levelOf(size);
+		if (level >= MAX_LEVEL) return allocateLarge(size);
+		
+		uintptr_t block = find(level);
+		if (block == 0) return nullptr;
+		entry(block) = (unsigned char) level;
+		return reinterpret_cast<void*>(block);
+	}
+	
+	/// Free memory of this heap
+	void deallocate(void *memory) {
+		if (memory == nullptr) return;
+		if (isLarge(memory)) {
+			deallocateLarge(memory);
+			return;
+		}
+		uintptr_t block = reinterpret_cast<uintptr_t>(memory);
+		insert(block, entry(block));
+	}
+	
+	/// Free memory of known size
+	///
+	/// The size given to allocate spares looking up the level of the block
+	void deallocate(void *memory, size_t size) {
+		if (memory == nullptr) return;
+		int level = levelOf(size);
+		if (level >= MAX_LEVEL) {
+			deallocateLarge(memory);
+			return;
+		}
+		uintptr_t block = reinterpret_cast<uintptr_t>(memory);
+		assert(entry(block) == level);
+		insert(block, level);
+	}
+	
+	/// Number of bytes usable at given memory
+	size_t usable(void *memory) const {
+		if (isLarge(memory)) return reinterpret_cast<Large*>(static_cast<char*>(memory) - LARGE_HEAD)->pages * PageSize - LARGE_HEAD;
+		return blockSize(entry(reinterpret_cast<uintptr_t>(memory)));
+	}
+	
+	/// Unmap superblocks that hold nothing but their side table
+	///
+	/// Returns the number of bytes unmapped
+	size_t trim() {
+		size_t released = 0;
+		uintptr_t *link = &superblocks;
+		while (*link != 0) {
+			uintptr_t superblock = *link;
+			if (!isEmpty(superblock)) {
+				link = &nextSuperblock(superblock);
+				continue;
+			}
+			for (int level = TABLE_LEVEL; level < MAX_LEVEL; ++level) unlink(superblock + blockSize(level), level);
+			*link = nextSuperblock(superblock);
+			munmap(reinterpret_cast<void*>(superblock), SUPERBLOCK);
+			released += SUPERBLOCK;
+		}
+		return released;
+	}
+
+private:
+	static constexpr unsigned char FREE = 0x80;	// flag of a side table entry, the rest of it is the level
+	
+	/// The side table has an entry per granule and takes the first block of its superblock
+	static constexpr size_t TABLE_BYTES = size_t(1) << MAX_LEVEL;
+	
+	/// The table block also links its superblock to the next one, behind the entries if there is room,
+	/// otherwise over entries of granules inside of the table block, no block of another level starts there
+	static constexpr int tableLevel() {
+		int level = Geometry::levelOf(TABLE_BYTES);
+		if (Geometry::blockSize(level) < TABLE_BYTES + sizeof(uintptr_t) && Geometry::blockSize(level) / GRANULE < 2 * sizeof(uintptr_t)) ++level;
+		return level;
+	}
+	
+	static constexpr int TABLE_LEVEL = tableLevel();
+	static constexpr size_t LINK_OFFSET = Geometry::blockSize(TABLE_LEVEL) >= TABLE_BYTES + sizeof(uintptr_t) ? TABLE_BYTES : sizeof(uintptr_t);
+	
+	/// Large memory starts past a granule boundary, which no block of a superblock does
+	static constexpr size_t LARGE_HEAD = 48;
+	
+	struct FreeBlock {
+		FreeBlock	*next, *prev;
+	};
+	
+	struct Large {
+		Large	*next, *prev;
+		size_t	pages;
+	};
+	
+	static_assert(LARGE_HEAD >= sizeof(Large) && LARGE_HEAD % ALIGNMENT == 0 && LARGE_HEAD % 32 != 0, "large memory stays aligned, but not to a granule");
+	
+	FreeBlock	*freeBlocks[Levels] = {};
+	unsigned	freeLevels = 0;				// bit i is set when freeBlocks[i] is not empty
+	uintptr_t	superblocks = 0;			// linked through their side tables
+	Large		*large = nullptr;
+	
+	/// Side table entry of the granule a block starts at
+	static unsigned char &entry(uintptr_t block) {
+		unsigned char *table = reinterpret_cast<unsigned char*>(block & ~(SUPERBLOCK - 1));
+		return table[(block & (SUPERBLOCK - 1)) >> MinShift];
+	}
+	
+	/// Link to the next superblock, kept in its table block
+	static uintptr_t &nextSuperblock(uintptr_t superblock) {
+		return *reinterpret_cast<uintptr_t*>(superblock + LINK_OFFSET);
+	}
+	
+	static bool isLarge(void *memory) {
+		return (reinterpret_cast<uintptr_t>(memory) & (GRANULE - 1)) != 0;
+	}
+	
+	/// Check if the side table is the only taken block of a superblock
+	static bool isEmpty(uintptr_t superblock) {
+		for (int level = TABLE_LEVEL; level < MAX_LEVEL; ++level) {
+			if (entry(superblock + blockSize(level)) != (level | FREE)) return false;
+		}
+		return true;
+	}
+	
+	void push(uintptr_t address, int level) {
+		FreeBlock *block = reinterpret_cast<FreeBlock*>(address);
+		block->prev = nullptr;
+		block->next = freeBlocks[level];
+		if (block->next) block->next->prev = block;
+		freeBlocks[level] = block;
+		freeLevels |= 1u << level;
+		entry(address) = (unsigned char)(level | FREE);
+	}
+	
+	void unlink(uintptr_t address, int level) {
+		FreeBlock *block = reinterpret_cast<FreeBlock*>(address);
+		if (block->next) block->next->prev = block->prev;
+		if (block->prev) {
+			block->prev->next = block->next;
+		} else {
+			freeBlocks[level] = block->next;
+			if (block->next == nullptr) freeLevels &= ~(1u << level);
+		}
+	}
+	
+	/// Map a new superblock and give all of it but the side table to the free lists
+	///
+	/// The OS only guarantees page alignment, so twice the size is mapped and the unaligned ends are cut off
+	bool mapSuperblock() {
+		char *mapped = static_cast<char*>(mmap(nullptr, 2 * SUPERBLOCK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+		if (mapped == MAP_FAILED) return false;
+		char *aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(mapped) + SUPERBLOCK - 1) & ~(SUPERBLOCK - 1));
+		if (aligned != mapped) munmap(mapped, aligned - mapped);
+		munmap(aligned + SUPERBLOCK, mapped + SUPERBLOCK - aligned);
+		
+		uintptr_t superblock = reinterpret_cast<uintptr_t>(aligned);
+		entry(superblock) = (unsigned char) TABLE_LEVEL;
+		for (int level = MAX_LEVEL - 1; level >= TABLE_LEVEL; --level) push(superblock + blockSize(level), level);
+		nextSuperblock(superblock) = superblocks;
+		superblocks = superblock;
+		return true;
+	}
+	
+	/// Get the next free block of given level
+	///
+	/// Takes the smallest free block of at least given level and splits it down, pushing the upper halves
+	uintptr_t find(int level) {
+		unsigned available = freeLevels & (~0u << level);
+		if (available == 0) {
+			if (!mapSuperblock()) return 0;
+			available = freeLevels & (~0u << level);
+		}
+		int index = __builtin_ctz(available);
+		uintptr_t block = reinterpret_cast<uintptr_t>(freeBlocks[index]);
+		unlink(block, index);
+		while (index > level) {
+			push(split(block, index), index - 1);
+			--index;
+		}
+		return block;
+	}
+	
+	/// Insert a block back, merging it with its free buddies
+	void insert(uintptr_t block, int level) {
+		while (level < MAX_LEVEL) {
+			uintptr_t bud = buddy(block, level);
+			if (entry(bud) != (level | FREE)) break;
+			unlink(bud, level);
+			block = primary(block, level);
+			++level;
+		}
+		push(block, level);
+	}
+	
+	void *allocateLarge(size_t size) {
+		if (size > SIZE_MAX - LARGE_HEAD - PageSize) return nullptr;
+		size_t pages = (size + LARGE_HEAD + PageSize - 1) / PageSize;
+		void *mapped = mmap(nullptr, pages * PageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mapped == MAP_FAILED) return nullptr;
+		
+		Large *block = static_cast<Large*>(mapped);
+		block->pages = pages;
+		block->prev = nullptr;
+		block->next = large;
+		if (large) large->prev = block;
+		large = block;
+		return static_cast<char*>(mapped) + LARGE_HEAD;
+	}
+	
+	void deallocateLarge(void *memory) {
+		Large *block = reinterpret_cast<Large*>(static_cast<char*>(memory) - LARGE_HEAD);
+		if (block->next) block->next->prev = block->prev;
+		if (block->prev) {
+			block->prev->next = block->next;
+		} else {
+			large = block->next;
+		}
+		munmap(block, block->pages * PageSize);
+	}
+};
+
+/// The geometry of balloc: 32 byte granules, 16 levels up to superblocks of 1MB
+using DefaultBuddyHeap = BuddyHeap<5, BSTATS_LEVELS, 4096>;
+
+static_assert(DefaultBuddyHeap::SUPERBLOCK == 1 << 20, "balloc maps superblocks of 1MB");
+
+
+/// Alignment of balloc and bheap_alloc, for requests of at least as many bytes
+constexpr size_t BALLOC_ALIGNMENT = 16;
+
+/// Memory resource of balloc, for std::pmr containers
+///
+/// Frees with bfree_sized, the size the containers pass back spares reading the level of the block
+/// Stateless, so all instances are equal, its thread safety is that of balloc
+class BuddyResource : public std::pmr::memory_resource {
+protected:
+	void *do_allocate(size_t bytes, size_t alignment) override {
+		if (bytes == 0) bytes = 1;
+		void *memory = (alignment <= BALLOC_ALIGNMENT && alignment <= bytes) ? balloc(bytes) : balloc_aligned(bytes, alignment);
+		if (memory == nullptr) throw std::bad_alloc();
+		return memory;
+	}
+	
+	void do_deallocate(void *memory, size_t bytes, size_t alignment) override {
+		if (bytes == 0) bytes = 1;
+		// Memory of balloc_aligned has no size to go by
+		if (alignment <= BALLOC_ALIGNMENT && alignment <= bytes) {
+			bfree_sized(memory, bytes);
+		} else {
+			bfree(memory);
+		}
+	}
+	
+	bool do_is_equal(std::pmr::memory_resource const &other) const noexcept override {
+		return dynamic_cast<BuddyResource const*>(&other) != nullptr;
+	}
+};
+
+/// Memory resource of a heap instance
+///
+/// Throws std::bad_alloc once the budget of the heap is exhausted
+/// The resource does not own its heap, bheap_reset drops everything allocated through it at once,
+/// so containers on a reset heap may only be destroyed or released, never used
+class BuddyHeapResource : public std::pmr::memory_resource {
+public:
+	explicit BuddyHeapResource(bheap_t *heap) : heap(heap) {}
+	
+	bheap_t *get() const {
+		return heap;
+	}
+	
+protected:
+	void *do_allocate(size_t bytes, size_t alignment) override {
+		if (bytes == 0) bytes = 1;
+		if (alignment <= BALLOC_ALIGNMENT) {
+			void *memory = bheap_alloc(heap, bytes);
+			if (memory == nullptr) throw std::bad_alloc();
+			return memory;
+		}
+		// A heap has no aligned allocation, so the memory is padded and keeps its unaligned address right in front of it
+		if (bytes > SIZE_MAX - alignment) throw std::bad_alloc();
+		void *unaligned = bheap_alloc(heap, bytes + alignment);
+		if (unaligned == nullptr) throw std::bad_alloc();
+		void **memory = reinterpret_cast<void**>((reinterpret_cast<uintptr_t>(unaligned) + alignment) & ~(alignment - 1));
+		memory[-1] = unaligned;
+		return memory;
+	}
+	
+	void do_deallocate(void *memory, size_t, size_t alignment) override {
+		bheap_free(heap, alignment <= BALLOC_ALIGNMENT ? memory : static_cast<void**>(memory)[-1]);
+	}
+	
+	bool do_is_equal(std::pmr::memory_resource const &other) const noexcept override {
+		BuddyHeapResource const *resource = dynamic_cast<BuddyHeapResource const*>(&other);
+		return resource != nullptr && resource->heap == heap;
+	}
+	
+private:
+	bheap_t	*heap;
+};
+
+/// Allocator of balloc, for containers that take an allocator type
+///
+/// Stateless like std::allocator, frees with bfree_sized
+template <class T>
+struct BuddyAllocator {
+	using value_type = T;
+	
+	BuddyAllocator() = default;
+	
+	template <class U>
+	BuddyAllocator(BuddyAllocator<U> const &) noexcept {}
+	
+	T *allocate(size_t count) {
+		if (count > SIZE_MAX / sizeof(T)) throw std::bad_array_new_length();
+		void *memory = alignof(T) <= BALLOC_ALIGNMENT ? balloc(bytes(count)) : balloc_aligned(bytes(count), alignof(T));
+		if (memory == nullptr) throw std::bad_alloc();
+		return static_cast<T*>(memory);
+	}
+	
+	void deallocate(T *memory, size_t count) noexcept {
+		if (alignof(T) <= BALLOC_ALIGNMENT) {
+			bfree_sized(memory, bytes(count));
+		} else {
+			bfree(memory);
+		}
+	}
+	
+	template <class U>
+	bool operator==(BuddyAllocator<U> const &) const noexcept {
+		return true;
+	}
+	
+	template <class U>
+	bool operator!=(BuddyAllocator<U> const &) const noexcept {
+		return false;
+	}
+	
+private:
+	/// Empty arrays still get an address of their own
+	static size_t bytes(size_t count) {
+		return count ? count * sizeof(T) : 1;
+	}
+};
@@ -0,0 +1,209 @@
+#define BENCH_BITMAP		1
+#include "bench.h"
+#include "btrace.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// Replayer of allocation traces
+//
+// Runs a trace recorded through bmalloc.c (built with -DTRACE=1) against the allocators to compare,
+// each in a process of its own, so their peak resident memory doesn't mix:
+// gcc -O2 buddy.c bitmem.c replay.c -o replay
+// ./replay [-a allocators] [-f csv] trace.bin
+//
+// Calls of all threads run on a single thread, in the order they were recorded, as fast as they go.
+// Fragmentation is the peak resident memory the allocator added over the peak of live requested bytes.
+
+
+#define FILL_BYTES			64			// bytes written at the start of every allocation
+#define PAGE				4096		// the rest gets a byte per page, so all of it is resident like in the program
+
+
+typedef struct Trace {
+	BTraceRecord const	*records;
+	size_t				count;
+	uint32_t			objects;
+	uint32_t			threads;
+} Trace;
+
+typedef struct Result {
+	double	nanos;			// time of the whole replay
+	size_t	peakLive;		// bytes requested and not yet freed, at their peak
+	size_t	peakResident;	// resident bytes over the ones before the replay, at their peak
+	size_t	endResident;	// resident bytes over the ones before the replay, once it ended
+	size_t	failed;			// allocations that returned NULL
+} Result;
+
+static Trace loadTrace(char const *path) {
+	Trace trace = {NULL, 0, 0, 0};
+	int file = open(path, O_RDONLY);
+	struct stat status;
+	if (file < 0 || fstat(file, &status) != 0 || (size_t) status.st_size < sizeof(BTraceHeader)) {
+		fprintf(stderr, "%s: can't read the trace\n", path);
+		exit(1);
+	}
+	// Read into private memory up front, so paging in the file is not part of the replay
+	void *data = mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, file, 0);
+	close(file);
+	BTraceHeader const *header = data;
+	if (data == MAP_FAILED || header->magic != BTRACE_MAGIC || header->recordSize != sizeof(BTraceRecord)) {
+		fprintf(stderr, "%s: not a trace of this format\n", path);
+		exit(1);
+	}
+	
+	trace.records = (BTraceRecord const*)(header + 1);
+	trace.count = (status.st_size - sizeof(BTraceHeader)) / sizeof(BTraceRecord);
+	if (header->records != 0 && header->records < trace.count) trace.count = header->records;
+	trace.threads = header->threads;
+	// A trace the process never stopped has no header counts, the records tell them
+	for (size_t i = 0; i < trace.count; ++i) {
+		if (trace.records[i].object >= trace.objects) trace.objects = trace.records[i].object + 1;
+		if (trace.records[i].thread > trace.threads) trace.threads = trace.records[i].thread;
+	}
+	return trace;
+}
+
+/// Replay every call of the trace, then free whatever it left allocated
+static Result replay(Allocator const *allocator, Trace const *trace) {
+	Result result = {0.0, 0, 0, 0, 0};
+	struct timespec start_time;
+	
+	void **memory = calloc(trace->objects, sizeof(void*));
+	size_t *sizes = calloc(trace->objects, sizeof(size_t));
+	if (memory == NULL || sizes == NULL) {
+		fprintf(stderr, "not enough memory for %u objects\n", trace->objects);
+		exit(1);
+	}
+	// calloc leaves the pages untouched, they count before the baseline and not while timed
+	memset(memory, 0, trace->objects * sizeof(void*));
+	memset(sizes, 0, trace->objects * sizeof(size_t));
+	
+	size_t baseline = readStatus("VmRSS");
+	int peakReset = resetPeak();
+	size_t live = 0;
+	
+	get_now(&start_time);
+	for (size_t i = 0; i < trace->count; ++i) {
+		BTraceRecord const *record = &trace->records[i];
+		uint32_t id = record->object;
+		size_t size = record->size ? record->size : 1;
+		void *new = NULL;
+		switch (record->op) {
+			case BTRACE_ALLOC:
+			case BTRACE_CALLOC:
+				new = allocator->allocate(size);
+				if (new != NULL && record->op == BTRACE_CALLOC) memset(new, 0, size);
+				break;
+			
+			case BTRACE_ALIGNED:
+				new = allocator->allocateAligned ? allocator->allocateAligned(size, (size_t)1 << record->alignment) : allocator->allocate(size);
+				break;
+			
+			case BTRACE_REALLOC:
+				if (allocator->reallocate) {
+					new = allocator->reallocate(memory[id], size);
+				} else {
+					new = allocator->allocate(size);
+					if (new != NULL) {
+						memcpy(new, memory[id], sizes[id] < size ? sizes[id] : size);
+						allocator->free(memory[id]);
+					}
+				}
+				if (new == NULL) break;
+				live -= sizes[id];
+				break;
+			
+			case BTRACE_FREE:
+				if (memory[id] == NULL) continue;
+				allocator->free(memory[id]);
+				memory[id] = NULL;
+				live -= sizes[id];
+				continue;
+		}
+		if (new == NULL) {
+			++result.failed;
+			continue;
+		}
+		memset(new, (int) id, size < FILL_BYTES ? size : FILL_BYTES);
+		for (size_t offset = PAGE; offset < size; offset += PAGE) ((char*) new)[offset] = (char) id;
+		memory[id] = new;
+		sizes[id] = size;
+		live += size;
+		if (live > result.peakLive) result.peakLive = live;
+	}
+	result.nanos = get_nanos_since(&start_time);
+	
+	size_t peak = peakReset ? readStatus("VmHWM") : readStatus("VmRSS");
+	size_t end = readStatus("VmRSS");
+	result.peakResident = peak > baseline ? (peak - baseline) * 1024 : 0;
+	result.endResident = end > baseline ? (end - baseline) * 1024 : 0;
+	
+	for (uint32_t id = 0; id < trace->objects; ++id) {
+		if (memory[id] != NULL) allocator->free(memory[id]);
+	}
+	free(sizes);
+	free(memory);
+	return result;
+}
+
+static void printResult(char const *name, Trace const *trace, Result const *result, int csv) {
+	double fragmentation = result->peakLive ? (double) result->peakResident / result->peakLive : 0.0;
+	if (csv) {
+		printf("%s,%zu,%.0f,%.3f,%zu,%zu,%zu,%.3f,%zu\n", name, trace->count, result->nanos, result->nanos / trace->count,
+			result->peakLive, result->peakResident, result->endResident, fragmentation, result->failed);
+	} else {
+		printf("%-12s || %10.2fms || %8.2fns || %10zuKB || %10zuKB || %10zuKB || %8.3f\n", name, result->nanos / 1000000, result->nanos / trace->count,
+			result->peakLive / 1024, result->peakResident / 1024, result->endResident / 1024, fragmentation);
+		if (result->failed) printf("%-12s    %zu allocations failed\n", "", result->failed);
+	}
+}
+
+static void usage(char const *program) {
+	fprintf(stderr, "usage: %s [-a allocators] [-f csv] trace\n", program);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	char const *names = NULL;
+	int csv = 0;
+	
+	int option;
+	while ((option = getopt(argc, argv, "a:f:")) != -1) {
+		switch (option) {
+			case 'a': names = optarg; break;
+			case 'f': csv = strcmp(optarg, "csv") == 0; if (!csv) usage(argv[0]); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (optind + 1 != argc) usage(argv[0]);
+	
+	Trace trace = loadTrace(argv[optind]);
+	if (csv) {
+		printf("allocator,calls,time_ns,ns_per_call,peak_live,peak_resident,end_resident,fragmentation,failed\n");
+	} else {
+		printf("%zu calls of %u threads on %u objects\n", trace.count, trace.threads, trace.objects);
+		printf("%-12s || %12s || %10s || %12s || %12s || %12s || %8s\n", "allocator", "time", "per call", "peak live", "peak RSS", "end RSS", "RSS/live");
+	}
+	fflush(stdout);
+	
+	for (size_t a = 0; a < ALLOCATOR_COUNT; ++a) {
+		if (!isSelected(names, ALLOCATORS[a].name)) continue;
+		pid_t child = fork();
+		if (child < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (child == 0) {
+			Result result = replay(&ALLOCATORS[a], &trace);
+			printResult(ALLOCATORS[a].name, &trace, &result, csv);
+			fflush(stdout);
+			_exit(0);
+		}
+		int status;
+		waitpid(child, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) fprintf(stderr, "%s: replay failed\n", ALLOCATORS[a].name);
+	}
+	return 0;
+}
@@ -0,0 +1,283 @@
+#include "bench.h"
+
+// Fragmentation soak benchmark
+//
+// Ages a heap over many allocations and frees, with the size distribution shifting every phase
+// and a few objects living much longer than the rest, then samples how much memory stays resident for the live bytes.
+// Resident memory is counted in pages of the whole process (from /proc/self/statm, no scan of the heap itself),
+// before and after trimming,
+// and for balloc the free memory is split into what btrim could return and what it can't.
+// gcc -O2 buddy.c soak.c -o soak
+// (add -DCOMPACT=1 to see the placement into the fullest pages)
+// ./soak -n 500000000 -f csv > soak.csv
+//
+// Options:
+// -n ops		allocations and frees in total (default 100000000)
+// -l objects	objects alive on average (default 100000)
+// -p ops		allocations and frees per phase of a size distribution (default ops / 20)
+// -s ops		allocations and frees between samples (default ops / 100)
+// -a name		allocator, default or buddy (default buddy)
+// -t			trim at every sample, to see what can't be returned
+// -f csv		print CSV instead of a table
+
+
+#define DEFAULT_OPS			100000000
+#define DEFAULT_LIVE		100000
+
+#define PAGE				4096
+#define PAGE_LEVEL			7			// level of blocks of a page
+#define STICKY_PERCENT		2			// objects that live until the sticky pool is full
+#define STICKY_SHARE		10			// the sticky pool holds up to this percent of the live objects
+
+
+typedef struct Object {
+	void	*memory;
+	size_t	size;
+} Object;
+
+/// Objects alive, freed objects are replaced by the last one
+typedef struct Pool {
+	Object	*objects;
+	size_t	count;
+	size_t	capacity;
+} Pool;
+
+static inline unsigned long long nextRandom(unsigned long long *seed) {
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+	return *seed;
+}
+
+/// Size distributions the phases go through
+///
+/// Each one leaves its objects behind in the next, so the heap sees them mixed the way a long running service does
+static size_t sizeOf(int phase, unsigned long long *seed) {
+	unsigned long long random = nextRandom(seed);
+	switch (phase % 5) {
+		case 0:		// small objects
+			return 8 + random % 249;
+		
+		case 1:		// log uniform up to 4KB
+			return ((size_t) 256 << (random % 5)) + (random >> 8) % 256;
+		
+		case 2:		// mostly small, some medium, a few large
+			if (random % 1000 < 800) return 16 + random % 112;
+			if (random % 1000 < 998) return 512 + (random >> 8) % 3584;
+			return 16384 + (random >> 8) % (256 * 1024);
+		
+		case 3:		// powers of 2 with a header, the worst case of a buddy allocator
+			return ((size_t) 64 << (random % 8)) + 16;
+		
+		default:	// a single size, like a pool of records
+			return 72;
+	}
+}
+
+/// Read the size and resident pages of the process from /proc/self/statm
+static void readPages(size_t *virtualPages, size_t *residentPages) {
+	*virtualPages = *residentPages = 0;
+	FILE *file = fopen("/proc/self/statm", "r");
+	if (file == NULL) return;
+	if (fscanf(file, "%zu %zu", virtualPages, residentPages) != 2) *virtualPages = *residentPages = 0;
+	fclose(file);
+}
+
+typedef struct Sample {
+	size_t	ops;
+	int		phase;
+	size_t	objects;
+	size_t	liveBytes;			// requested by the objects alive
+	size_t	residentPages;		// added since the start
+	size_t	trimmedPages;		// added since the start, once trimmed (if it was)
+	size_t	allocatedBytes;		// of blocks handed out and not freed, buddy only
+	size_t	returnableBytes;	// free memory btrim can give back, buddy only
+	size_t	strandedBytes;		// free memory btrim can't give back, buddy only
+} Sample;
+
+/// Split the free memory of balloc into what btrim returns and what stays
+///
+/// Blocks smaller than a page share it with taken ones (free buddies merge), btrim keeps the first page of larger ones
+/// The rest of the larger ones may already be given back (or never touched), that isn't resident and returns nothing
+static void splitFree(Sample *sample) {
+	BuddyStats stats = bstats();
+	sample->allocatedBytes = stats.bytesAllocated - stats.bytesFreed;
+	sample->returnableBytes = sample->strandedBytes = 0;
+	for (int level = 0; level < BSTATS_LEVELS; ++level) {
+		if (level < PAGE_LEVEL) {
+			sample->strandedBytes += stats.freeBytes[level];
+		} else {
+			sample->strandedBytes += stats.freeBlocks[level] * PAGE;
+			sample->returnableBytes += stats.freeBytes[level] - stats.freeBlocks[level] * PAGE;
+		}
+	}
+	sample->returnableBytes -= stats.bytesDecommitted < sample->returnableBytes ? stats.bytesDecommitted : sample->returnableBytes;
+}
+
+/// Resident pages over the pages the live bytes need at least
+static double residentOverLive(Sample const *sample) {
+	size_t livePages = (sample->liveBytes + PAGE - 1) / PAGE;
+	return livePages ? (double) sample->residentPages / livePages : 0.0;
+}
+
+static void printSample(Sample const *sample, int buddy, int csv) {
+	size_t livePages = (sample->liveBytes + PAGE - 1) / PAGE;
+	double ratio = residentOverLive(sample);
+	long unreturnable = (long) sample->trimmedPages - (long) livePages;
+	if (csv) {
+		printf("%zu,%d,%zu,%zu,%zu,%zu,%.4f,%ld", sample->ops, sample->phase, sample->objects, sample->liveBytes, sample->residentPages, sample->trimmedPages, ratio, unreturnable);
+		if (buddy) printf(",%zu,%zu,%zu", sample->allocatedBytes, sample->returnableBytes, sample->strandedBytes);
+		printf("\n");
+	} else {
+		printf("%12zu || %5d || %8zu || %10zuKB || %8zu || %8zu || %7.3f || %8ld", sample->ops, sample->phase, sample->objects, sample->liveBytes / 1024,
+			sample->residentPages, sample->trimmedPages, ratio, unreturnable);
+		if (buddy) printf(" || %10zuKB || %10zuKB || %10zuKB", sample->allocatedBytes / 1024, sample->returnableBytes / 1024, sample->strandedBytes / 1024);
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+/// Allocator of given name, NULL if there is none
+static Allocator const *findAllocator(char const *name) {
+	for (size_t a = 0; a < ALLOCATOR_COUNT; ++a) {
+		if (strcmp(name, ALLOCATORS[a].name) == 0) return &ALLOCATORS[a];
+	}
+	return NULL;
+}
+
+static void usage(char const *program) {
+	fprintf(stderr, "usage: %s [-n ops] [-l objects] [-p ops] [-s ops] [-a allocator] [-t] [-f csv]\n", program);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	size_t ops = DEFAULT_OPS;
+	size_t live = DEFAULT_LIVE;
+	size_t phaseOps = 0;
+	size_t sampleOps = 0;
+	Allocator const *allocator = findAllocator("buddy");
+	int trim = 0;
+	int csv = 0;
+	
+	int option;
+	while ((option = getopt(argc, argv, "n:l:p:s:a:tf:")) != -1) {
+		switch (option) {
+			case 'n': ops = strtoull(optarg, NULL, 0); break;
+			case 'l': live = strtoull(optarg, NULL, 0); break;
+			case 'p': phaseOps = strtoull(optarg, NULL, 0); break;
+			case 's': sampleOps = strtoull(optarg, NULL, 0); break;
+			case 't': trim = 1; break;
+			case 'f': csv = strcmp(optarg, "csv") == 0; if (!csv) usage(argv[0]); break;
+			case 'a': allocator = findAllocator(optarg); if (allocator == NULL) usage(argv[0]); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (phaseOps == 0) phaseOps = ops / 20;
+	if (sampleOps == 0) sampleOps = ops / 100;
+	if (ops == 0 || live == 0 || phaseOps == 0 || sampleOps == 0) usage(argv[0]);
+	int buddy = allocator->allocate == balloc;
+	
+	// Pools are set up (and touched) before the baseline, so only the heap adds to the pages
+	size_t stickyLimit = live * STICKY_SHARE / 100 + 1;
+	Pool pool = {calloc(2 * live, sizeof(Object)), 0, 2 * live};
+	Pool sticky = {calloc(stickyLimit, sizeof(Object)), 0, stickyLimit};
+	if (pool.objects == NULL || sticky.objects == NULL) {
+		fprintf(stderr, "not enough memory for %zu objects\n", live);
+		return 1;
+	}
+	memset(pool.objects, 0, pool.capacity * sizeof(Object));
+	memset(sticky.objects, 0, sticky.capacity * sizeof(Object));
+	size_t virtualPages, baseline;
+	readPages(&virtualPages, &baseline);
+	
+	if (csv) {
+		printf("ops,phase,objects,live_bytes,resident_pages,trimmed_pages,resident_over_live,unreturnable_pages");
+		if (buddy) printf(",allocated_bytes,returnable_bytes,stranded_bytes");
+		printf("\n");
+	} else {
+		printf("%s, %zu objects alive on average, phases of %zu ops, %s\n", allocator->name, live, phaseOps, trim ? "trimmed at every sample" : "never trimmed");
+		printf("%12s || %5s || %8s || %12s || %8s || %8s || %7s || %8s", "ops", "phase", "objects", "live", "resident", "trimmed", "ratio", "stuck");
+		if (buddy) printf(" || %12s || %12s || %12s", "allocated", "returnable", "stranded");
+		printf("\n");
+	}
+	
+	unsigned long long seed = 88172645463325252ULL;
+	size_t liveBytes = 0;
+	double firstRatio = 0.0, lastRatio = 0.0, peakRatio = 0.0;
+	for (size_t op = 1; op <= ops; ++op) {
+		int phase = (int)(op / phaseOps);
+		unsigned long long random = nextRandom(&seed);
+		// Allocations win below the average number of objects and frees above it, so the count wanders around it
+		int allocate = pool.count == 0 || (pool.count < pool.capacity && random % (2 * live) >= pool.count);
+		if (allocate) {
+			size_t size = sizeOf(phase, &seed);
+			void *memory = allocator->allocate(size);
+			if (memory == NULL) {
+				fprintf(stderr, "allocation of %zu bytes failed after %zu ops\n", size, op);
+				return 1;
+			}
+			// Every page is written, so it is resident like in a program using the memory
+			*(long int *) memory = (long int) memory;
+			for (size_t offset = PAGE; offset < size; offset += PAGE) ((char*) memory)[offset] = (char) op;
+			liveBytes += size;
+			Object object = {memory, size};
+			// A few objects outlive the rest, pinning the memory around them
+			if ((random >> 32) % 100 < STICKY_PERCENT) {
+				if (sticky.count == sticky.capacity) {
+					size_t victim = (random >> 16) % sticky.count;
+					void *evicted = sticky.objects[victim].memory;
+					if (*(long int *) evicted != (long int) evicted) {
+						fprintf(stderr, "object at %p was overwritten\n", evicted);
+						return 1;
+					}
+					allocator->free(evicted);
+					liveBytes -= sticky.objects[victim].size;
+					sticky.objects[victim] = object;
+				} else {
+					sticky.objects[sticky.count++] = object;
+				}
+			} else {
+				pool.objects[pool.count++] = object;
+			}
+		} else {
+			size_t victim = (random >> 16) % pool.count;
+			Object *object = &pool.objects[victim];
+			if (*(long int *) object->memory != (long int) object->memory) {
+				fprintf(stderr, "object at %p was overwritten\n", object->memory);
+				return 1;
+			}
+			allocator->free(object->memory);
+			liveBytes -= object->size;
+			*object = pool.objects[--pool.count];
+		}
+		
+		if (op % sampleOps == 0 || op == ops) {
+			Sample sample = {op, phase, pool.count + sticky.count, liveBytes, 0, 0, 0, 0, 0};
+			size_t resident;
+			readPages(&virtualPages, &resident);
+			sample.residentPages = resident > baseline ? resident - baseline : 0;
+			if (buddy) splitFree(&sample);
+			if (trim) {
+				allocator->trim();
+				readPages(&virtualPages, &resident);
+			}
+			sample.trimmedPages = resident > baseline ? resident - baseline : 0;
+			printSample(&sample, buddy, csv);
+			
+			double ratio = residentOverLive(&sample);
+			if (firstRatio == 0.0) firstRatio = ratio;
+			lastRatio = ratio;
+			if (ratio > peakRatio) peakRatio = ratio;
+		}
+	}
+	
+	if (!csv) {
+		printf("\nresident over live: first sample %.3f, last sample %.3f, peak %.3f\n", firstRatio, lastRatio, peakRatio);
+	}
+	
+	for (size_t i = 0; i < pool.count; ++i) allocator->free(pool.objects[i].memory);
+	for (size_t i = 0; i < sticky.count; ++i) allocator->free(sticky.objects[i].memory);
+	free(sticky.objects);
+	free(pool.objects);
+	return 0;
+}
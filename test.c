@@ -1,4 +1,5 @@
 #include "buddy.h"
+#include "bitmem.h"
 
 #include <assert.h>
 #include <time.h>
@@ -15,8 +16,23 @@
 
 #define TEST_COUNT			11
 
+#define MICRO_COUNT			6
+#define MICRO_ROUNDS		20000
+#define MICRO_BATCH			64
+
+#define REALLOC_COUNT		3
+#define REALLOC_ROUNDS		2000
+#define REALLOC_BUFFERS		16			// buffers growing side by side
+#define REALLOC_LIMIT		65536		// every buffer grows up to this many bytes
+#define REALLOC_STEP		24			// bytes appended at a time by the string builder
+
+#define REQUEST_COUNT		3
+#define REQUEST_ROUNDS		200
+#define REQUEST_OBJECTS		4096		// objects allocated by every request, all dropped at its end
+
 #define ENABLE_DEFAULT	1
 #define ENABLE_BUDDY	1
+#define ENABLE_BITMAP	1
 
 static char const * const TIME_UNIT = "us";
 
@@ -38,6 +54,50 @@ static inline double get_time_since(struct timespec *time) {
 /// The third parameter is a pointer to an array of doubles of size TEST_COUNT to store resulting times in
 void benchmark(void *(*allocateFunc)(size_t), void (*freeFunc)(void *), double *times);
 
+/// Sizes used by the microbenchmark, one column each
+static size_t const MICRO_SIZES[MICRO_COUNT] = {8, 24, 120, 500, 2000, 16384};
+
+/// Measure per call cost of given allocate and free functions
+///
+/// Repeatedly allocates MICRO_BATCH blocks of every size in MICRO_SIZES and frees them again
+/// The third parameter is a pointer to an array of doubles of size MICRO_COUNT to store nanoseconds per call in
+void microbenchmark(void *(*allocateFunc)(size_t), void (*freeFunc)(void *), double *nanos);
+
+/// Measure per object cost of allocating and freeing MICRO_BATCH blocks at once
+///
+/// Same rounds as the microbenchmark, once with balloc and bfree in a loop and once with balloc_batch and bfree_batch
+/// The parameters are pointers to arrays of doubles of size MICRO_COUNT to store nanoseconds per object in
+void batchbenchmark(double *loopNanos, double *batchNanos);
+
+/// Names of the realloc phases, one row each
+static char const * const REALLOC_NAMES[REALLOC_COUNT] = {"single vector", "interleaved vectors", "string builders"};
+
+/// Measure the cost of growing buffers with given reallocate function
+///
+/// A vector doubles its capacity, a string builder appends REALLOC_STEP bytes at a time
+/// The fourth parameter is a pointer to an array of doubles of size REALLOC_COUNT to store resulting times in
+void reallocbenchmark(void *(*allocateFunc)(size_t), void *(*reallocateFunc)(void *, size_t), void (*freeFunc)(void *), double *times);
+
+/// Names of the ways to drop the objects of a request, one row each
+static char const * const REQUEST_NAMES[REQUEST_COUNT] = {"balloc, bfree", "heap, bheap_free", "heap, bheap_reset"};
+
+/// Measure the cost of requests that allocate REQUEST_OBJECTS objects of MICRO_SIZES and drop them at their end
+///
+/// Once through the default heap, once through a heap of the request freeing every object and once resetting that heap
+/// The parameter is a pointer to an array of doubles of size REQUEST_COUNT to store resulting times in
+void requestbenchmark(double *times);
+
+/// Resize by allocating, copying and freeing, as growing a buffer took before brealloc
+void *copyRealloc(void *memory, size_t size) {
+	void *new = balloc(size);
+	if (memory != NULL) {
+		size_t usable = bsize(memory);
+		memcpy(new, memory, usable < size ? usable : size);
+		bfree(memory);
+	}
+	return new;
+}
+
 int main() {
 	/*
 	printf("Running test.\n");
@@ -47,10 +107,18 @@ int main() {
 	
 	double default_times[TEST_COUNT] = {0.0};
 	double buddy_times[TEST_COUNT] = {0.0};
+	double bitmap_times[TEST_COUNT] = {0.0};
 	
 	struct timespec start_time;
 	double duration;
 	
+#if ENABLE_BUDDY
+	// A block shrunk to the size of a slab object has to be freed by that size as one
+	void *shrunk = brealloc(balloc(200), 100);
+	assert(shrunk != NULL);
+	bfree_sized(shrunk, 100);
+#endif // ENABLE_BUDDY
+	
 #if ENABLE_DEFAULT
 	printf("Benchmarking default memory management:\n");
 	get_now(&start_time);
@@ -64,29 +132,111 @@ int main() {
 	get_now(&start_time);
 	benchmark(&balloc, &bfree, buddy_times);
 	duration = get_time_since(&start_time);
-	printf("\nBuddy memory management took total of %f%s\n\n", duration, TIME_UNIT);
+	printf("\nBuddy memory management took total of %f%s\n", duration, TIME_UNIT);
+	BuddyStats stats = bstats();
+	bstats_print(stdout, &stats, 0);
+#if LATENCY
+	blatency_print(stdout, 0);
+#endif // LATENCY
+	printf("Trimming released %zuKB\n\n", btrim() / 1024);
 #endif // ENABLE_BUDDY
+
+#if ENABLE_BITMAP
+	printf("Benchmarking bitmap memory management:\n");
+	get_now(&start_time);
+	benchmark(&bm_alloc, &bm_free, bitmap_times);
+	duration = get_time_since(&start_time);
+	printf("\nBitmap memory management took total of %f%s\n\n", duration, TIME_UNIT);
+#endif // ENABLE_BITMAP
 	
 	printf("Resulting times:\n");
-	printf("test                        ||   default  ||    buddy\n");
-	printf("tiny allocations            || %8.2f%s || %8.2f%s\n", default_times[0], TIME_UNIT, buddy_times[0], TIME_UNIT);
-	printf("zig-zag                     || %8.2f%s || %8.2f%s\n", default_times[1], TIME_UNIT, buddy_times[1], TIME_UNIT);
-	printf("occasional free             || %8.2f%s || %8.2f%s\n", default_times[2], TIME_UNIT, buddy_times[2], TIME_UNIT);
-	printf("large allocations           || %8.2f%s || %8.2f%s\n", default_times[3], TIME_UNIT, buddy_times[3], TIME_UNIT);
-	printf("increasing size allocations || %8.2f%s || %8.2f%s\n", default_times[4], TIME_UNIT, buddy_times[4], TIME_UNIT);
-	printf("sweeping free               || %8.2f%s || %8.2f%s\n", default_times[5], TIME_UNIT, buddy_times[5], TIME_UNIT);
-	printf("clamped allocations         || %8.2f%s || %8.2f%s\n", default_times[6], TIME_UNIT, buddy_times[6], TIME_UNIT);
-	printf("random allocations          || %8.2f%s || %8.2f%s\n", default_times[7], TIME_UNIT, buddy_times[7], TIME_UNIT);
-	printf("even free                   || %8.2f%s || %8.2f%s\n", default_times[8], TIME_UNIT, buddy_times[8], TIME_UNIT);
-	printf("flipping                    || %8.2f%s || %8.2f%s\n", default_times[9], TIME_UNIT, buddy_times[9], TIME_UNIT);
-	printf("complete cleanup            || %8.2f%s || %8.2f%s\n", default_times[10], TIME_UNIT, buddy_times[10], TIME_UNIT);
+	printf("test                        ||   default  ||    buddy   ||   bitmap\n");
+	printf("tiny allocations            || %8.2f%s || %8.2f%s || %8.2f%s\n", default_times[0], TIME_UNIT, buddy_times[0], TIME_UNIT, bitmap_times[0], TIME_UNIT);
+	printf("zig-zag                     || %8.2f%s || %8.2f%s || %8.2f%s\n", default_times[1], TIME_UNIT, buddy_times[1], TIME_UNIT, bitmap_times[1], TIME_UNIT);
+	printf("occasional free             || %8.2f%s || %8.2f%s || %8.2f%s\n", default_times[2], TIME_UNIT, buddy_times[2], TIME_UNIT, bitmap_times[2], TIME_UNIT);
+	printf("large allocations           || %8.2f%s || %8.2f%s || %8.2f%s\n", default_times[3], TIME_UNIT, buddy_times[3], TIME_UNIT, bitmap_times[3], TIME_UNIT);
+	printf("increasing size allocations || %8.2f%s || %8.2f%s || %8.2f%s\n", default_times[4], TIME_UNIT, buddy_times[4], TIME_UNIT, bitmap_times[4], TIME_UNIT);
+	printf("sweeping free               || %8.2f%s || %8.2f%s || %8.2f%s\n", default_times[5], TIME_UNIT, buddy_times[5], TIME_UNIT, bitmap_times[5], TIME_UNIT);
+	printf("clamped allocations         || %8.2f%s || %8.2f%s || %8.2f%s\n", default_times[6], TIME_UNIT, buddy_times[6], TIME_UNIT, bitmap_times[6], TIME_UNIT);
+	printf("random allocations          || %8.2f%s || %8.2f%s || %8.2f%s\n", default_times[7], TIME_UNIT, buddy_times[7], TIME_UNIT, bitmap_times[7], TIME_UNIT);
+	printf("even free                   || %8.2f%s || %8.2f%s || %8.2f%s\n", default_times[8], TIME_UNIT, buddy_times[8], TIME_UNIT, bitmap_times[8], TIME_UNIT);
+	printf("flipping                    || %8.2f%s || %8.2f%s || %8.2f%s\n", default_times[9], TIME_UNIT, buddy_times[9], TIME_UNIT, bitmap_times[9], TIME_UNIT);
+	printf("complete cleanup            || %8.2f%s || %8.2f%s || %8.2f%s\n", default_times[10], TIME_UNIT, buddy_times[10], TIME_UNIT, bitmap_times[10], TIME_UNIT);
 	double default_duration = 0.0;
 	double buddy_duration = 0.0;
+	double bitmap_duration = 0.0;
 	for (int i = 0; i < TEST_COUNT; ++i) {
 		default_duration += default_times[i];
 		buddy_duration += buddy_times[i];
+		bitmap_duration += bitmap_times[i];
+	}
+	printf("total time                  || %8.2f%s || %8.2f%s || %8.2f%s\n", default_duration, TIME_UNIT, buddy_duration, TIME_UNIT, bitmap_duration, TIME_UNIT);
+	
+	double default_nanos[MICRO_COUNT] = {0.0};
+	double buddy_nanos[MICRO_COUNT] = {0.0};
+	double bitmap_nanos[MICRO_COUNT] = {0.0};
+	
+#if ENABLE_DEFAULT
+	microbenchmark(&malloc, &free, default_nanos);
+#endif // ENABLE_DEFAULT
+
+#if ENABLE_BUDDY
+	microbenchmark(&balloc, &bfree, buddy_nanos);
+#endif // ENABLE_BUDDY
+
+#if ENABLE_BITMAP
+	microbenchmark(&bm_alloc, &bm_free, bitmap_nanos);
+#endif // ENABLE_BITMAP
+	
+	printf("\nPer call cost (%d rounds of %d allocations and frees):\n", MICRO_ROUNDS, MICRO_BATCH);
+	printf("size                        ||   default  ||    buddy   ||   bitmap\n");
+	for (int i = 0; i < MICRO_COUNT; ++i) {
+		printf("%-27zu || %8.2fns || %8.2fns || %8.2fns\n", MICRO_SIZES[i], default_nanos[i], buddy_nanos[i], bitmap_nanos[i]);
+	}
+	
+	double loop_nanos[MICRO_COUNT] = {0.0};
+	double batch_nanos[MICRO_COUNT] = {0.0};
+	
+#if ENABLE_BUDDY
+	batchbenchmark(loop_nanos, batch_nanos);
+#endif // ENABLE_BUDDY
+	
+	printf("\nBuddy batches (%d rounds of %d blocks, per allocation and free):\n", MICRO_ROUNDS, MICRO_BATCH);
+	printf("size                        ||    loop    ||    batch\n");
+	for (int i = 0; i < MICRO_COUNT; ++i) {
+		printf("%-27zu || %8.2fns || %8.2fns\n", MICRO_SIZES[i], loop_nanos[i], batch_nanos[i]);
+	}
+	
+	double default_realloc[REALLOC_COUNT] = {0.0};
+	double buddy_realloc[REALLOC_COUNT] = {0.0};
+	double copy_realloc[REALLOC_COUNT] = {0.0};
+	
+#if ENABLE_DEFAULT
+	reallocbenchmark(&malloc, &realloc, &free, default_realloc);
+#endif // ENABLE_DEFAULT
+
+#if ENABLE_BUDDY
+	reallocbenchmark(&balloc, &brealloc, &bfree, buddy_realloc);
+	reallocbenchmark(&balloc, &copyRealloc, &bfree, copy_realloc);
+#endif // ENABLE_BUDDY
+	
+	printf("\nGrowing buffers (%d rounds up to %d bytes):\n", REALLOC_ROUNDS, REALLOC_LIMIT);
+	printf("test                        ||   default  ||    buddy   || buddy copy\n");
+	for (int i = 0; i < REALLOC_COUNT; ++i) {
+		printf("%-27s || %8.2f%s || %8.2f%s || %8.2f%s\n", REALLOC_NAMES[i], default_realloc[i], TIME_UNIT, buddy_realloc[i], TIME_UNIT, copy_realloc[i], TIME_UNIT);
+	}
+	
+	double request_times[REQUEST_COUNT] = {0.0};
+	
+#if ENABLE_BUDDY
+	requestbenchmark(request_times);
+#endif // ENABLE_BUDDY
+	
+	printf("\nRequests (%d rounds of %d objects):\n", REQUEST_ROUNDS, REQUEST_OBJECTS);
+	printf("test                        ||    time\n");
+	for (int i = 0; i < REQUEST_COUNT; ++i) {
+		printf("%-27s || %8.2f%s\n", REQUEST_NAMES[i], request_times[i], TIME_UNIT);
 	}
-	printf("total time                  || %8.2f%s || %8.2f%s\n", default_duration, TIME_UNIT, buddy_duration, TIME_UNIT);
 	return 0;
 }
 
@@ -327,3 +477,154 @@ void benchmark(void *(*allocF)(size_t), void (*freeF)(void *), double *times) {
 	printMemUsage(&memUsage);
 	printf("\nbenchmark done\n");
 }
+
+/// Run a microbenchmark using given allocator and deallocator
+void microbenchmark(void *(*allocF)(size_t), void (*freeF)(void *), double *nanos) {
+	struct timespec start_time;
+	
+	void *batch[MICRO_BATCH];
+	
+	for (int i = 0; i < MICRO_COUNT; ++i) {
+		size_t size = MICRO_SIZES[i];
+		get_now(&start_time);
+		for (int round = 0; round < MICRO_ROUNDS; ++round) {
+			for (int j = 0; j < MICRO_BATCH; ++j) {
+				batch[j] = allocF(size);
+				*(long int *)batch[j] = (long int) batch[j];
+			}
+			for (int j = 0; j < MICRO_BATCH; ++j) {
+				freeF(batch[j]);
+			}
+		}
+		// time is measured in TIME_UNIT, convert to nanoseconds per single call
+		nanos[i] = get_time_since(&start_time) * NANOS_PER_TU / ((double) MICRO_ROUNDS * MICRO_BATCH * 2);
+	}
+}
+
+/// Run the batch benchmark on the buddy allocator
+void batchbenchmark(double *loopNanos, double *batchNanos) {
+	struct timespec start_time;
+	
+	void *batch[MICRO_BATCH];
+	
+	for (int i = 0; i < MICRO_COUNT; ++i) {
+		size_t size = MICRO_SIZES[i];
+		get_now(&start_time);
+		for (int round = 0; round < MICRO_ROUNDS; ++round) {
+			for (int j = 0; j < MICRO_BATCH; ++j) {
+				batch[j] = balloc(size);
+				*(long int *)batch[j] = (long int) batch[j];
+			}
+			for (int j = 0; j < MICRO_BATCH; ++j) {
+				bfree(batch[j]);
+			}
+		}
+		loopNanos[i] = get_time_since(&start_time) * NANOS_PER_TU / ((double) MICRO_ROUNDS * MICRO_BATCH);
+		
+		get_now(&start_time);
+		for (int round = 0; round < MICRO_ROUNDS; ++round) {
+			size_t taken = balloc_batch(size, MICRO_BATCH, batch);
+			assert(taken == MICRO_BATCH);
+			for (int j = 0; j < MICRO_BATCH; ++j) {
+				*(long int *)batch[j] = (long int) batch[j];
+			}
+			bfree_batch(batch, MICRO_BATCH);
+		}
+		batchNanos[i] = get_time_since(&start_time) * NANOS_PER_TU / ((double) MICRO_ROUNDS * MICRO_BATCH);
+	}
+}
+
+/// Run the realloc benchmark using given allocator, reallocator and deallocator
+void reallocbenchmark(void *(*allocF)(size_t), void *(*reallocF)(void *, size_t), void (*freeF)(void *), double *times) {
+	struct timespec start_time;
+	
+	char *buffers[REALLOC_BUFFERS];
+	
+	// A single vector has nothing next to it, so its buddies are free to take
+	get_now(&start_time);
+	for (int round = 0; round < REALLOC_ROUNDS; ++round) {
+		char *vector = (char*) allocF(16);
+		for (size_t size = 32; size <= REALLOC_LIMIT; size *= 2) {
+			vector = (char*) reallocF(vector, size);
+			assert(vector != NULL);
+			vector[size - 1] = (char) size;
+		}
+		freeF(vector);
+	}
+	times[0] = get_time_since(&start_time);
+	
+	// Vectors growing side by side compete for the same buddies
+	get_now(&start_time);
+	for (int round = 0; round < REALLOC_ROUNDS / REALLOC_BUFFERS; ++round) {
+		for (int i = 0; i < REALLOC_BUFFERS; ++i) buffers[i] = (char*) allocF(16);
+		for (size_t size = 32; size <= REALLOC_LIMIT; size *= 2) {
+			for (int i = 0; i < REALLOC_BUFFERS; ++i) {
+				buffers[i] = (char*) reallocF(buffers[i], size);
+				assert(buffers[i] != NULL);
+				buffers[i][size - 1] = (char) size;
+			}
+		}
+		for (int i = 0; i < REALLOC_BUFFERS; ++i) freeF(buffers[i]);
+	}
+	times[1] = get_time_since(&start_time);
+	
+	// A string builder asks for a little more every time, most of the calls fit into the current block
+	get_now(&start_time);
+	for (int round = 0; round < REALLOC_ROUNDS / REALLOC_BUFFERS; ++round) {
+		for (int i = 0; i < 4; ++i) buffers[i] = (char*) allocF(REALLOC_STEP);
+		for (size_t size = 2 * REALLOC_STEP; size <= REALLOC_LIMIT / 4; size += REALLOC_STEP) {
+			for (int i = 0; i < 4; ++i) {
+				buffers[i] = (char*) reallocF(buffers[i], size);
+				assert(buffers[i] != NULL);
+				memset(buffers[i] + size - REALLOC_STEP, 'a' + i, REALLOC_STEP);
+			}
+		}
+		for (int i = 0; i < 4; ++i) freeF(buffers[i]);
+	}
+	times[2] = get_time_since(&start_time);
+}
+
+void requestbenchmark(double *times) {
+	struct timespec start_time;
+	
+	void **objects = (void**) malloc(sizeof(void*) * REQUEST_OBJECTS);
+	bheap_t *heap = bheap_create(0);
+	assert(objects != NULL && heap != NULL);
+	
+	get_now(&start_time);
+	for (int round = 0; round < REQUEST_ROUNDS; ++round) {
+		for (int i = 0; i < REQUEST_OBJECTS; ++i) {
+			objects[i] = balloc(MICRO_SIZES[i % MICRO_COUNT]);
+			*(long int *)objects[i] = (long int) i;
+		}
+		for (int i = 0; i < REQUEST_OBJECTS; ++i) {
+			bfree(objects[i]);
+		}
+	}
+	times[0] = get_time_since(&start_time);
+	
+	get_now(&start_time);
+	for (int round = 0; round < REQUEST_ROUNDS; ++round) {
+		for (int i = 0; i < REQUEST_OBJECTS; ++i) {
+			objects[i] = bheap_alloc(heap, MICRO_SIZES[i % MICRO_COUNT]);
+			*(long int *)objects[i] = (long int) i;
+		}
+		for (int i = 0; i < REQUEST_OBJECTS; ++i) {
+			bheap_free(heap, objects[i]);
+		}
+	}
+	times[1] = get_time_since(&start_time);
+	
+	get_now(&start_time);
+	for (int round = 0; round < REQUEST_ROUNDS; ++round) {
+		for (int i = 0; i < REQUEST_OBJECTS; ++i) {
+			objects[i] = bheap_alloc(heap, MICRO_SIZES[i % MICRO_COUNT]);
+			*(long int *)objects[i] = (long int) i;
+		}
+		bheap_reset(heap);
+	}
+	times[2] = get_time_since(&start_time);
+	
+	bheap_destroy(heap);
+	free(objects);
+}
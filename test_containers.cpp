@@ -0,0 +1,118 @@
+#include "buddy.hpp"
+#include "timing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <list>
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+// Container churn benchmark
+//
+// buddy.c stays C, build it separately:
+// gcc -O2 -c buddy.c && g++ -O2 -std=c++17 buddy.o test_containers.cpp
+
+
+#define TU_PER_SEC			1000000
+#define NANOS_PER_TU		(GIGA / TU_PER_SEC)
+
+#define CHURN_COUNT			3
+#define CHURN_ROUNDS		2000000		// inserts, every one paired with an erase once the container is full
+#define CHURN_KEYS			65536		// elements alive at a time
+#define ALLOCATOR_COUNT		4
+
+#define HEAP_BUDGET			(64 << 20)
+
+static char const * const TIME_UNIT = "us";
+
+static char const * const CHURN_NAMES[CHURN_COUNT] = {"map insert-erase", "list push-pop", "unordered_map insert-erase"};
+static char const * const ALLOCATOR_NAMES[ALLOCATOR_COUNT] = {"default", "allocator", "pmr", "pmr heap"};
+
+
+/// Keys of the churn, the same sequence for every allocator
+static unsigned nextKey(unsigned *seed) {
+	*seed = *seed * 1103515245 + 12345;
+	return (*seed >> 8) % (CHURN_KEYS * 2);
+}
+
+/// Insert random keys into a map, erasing random ones too once it holds CHURN_KEYS of them
+///
+/// Keys come from twice as many as CHURN_KEYS, so inserts and erases hit about as often at that size
+template <class Map>
+double mapChurn(Map &map) {
+	struct timespec start_time;
+	unsigned seed = 1, eraseSeed = 2;
+	
+	get_now(&start_time);
+	for (int round = 0; round < CHURN_ROUNDS; ++round) {
+		map[nextKey(&seed)] = round;
+		if (map.size() > CHURN_KEYS) map.erase(nextKey(&eraseSeed));
+	}
+	return get_nanos_since(&start_time) / NANOS_PER_TU;
+}
+
+/// Push to the back of a list and pop from its front, in bursts so the list grows and shrinks
+template <class List>
+double listChurn(List &list) {
+	struct timespec start_time;
+	unsigned seed = 1;
+	
+	get_now(&start_time);
+	for (int round = 0; round < CHURN_ROUNDS; round += CHURN_KEYS / 4) {
+		for (int i = 0; i < CHURN_KEYS / 4; ++i) list.push_back(nextKey(&seed));
+		while (list.size() > CHURN_KEYS) list.pop_front();
+		// Erase every third element too, so the nodes that go back are not in the order they came
+		int i = 0;
+		for (auto it = list.begin(); it != list.end(); ++i) it = i % 3 ? std::next(it) : list.erase(it);
+	}
+	return get_nanos_since(&start_time) / NANOS_PER_TU;
+}
+
+/// Run all churns on containers of given allocator type
+template <template <class> class Allocator, class ...Args>
+void churnbenchmark(double *times, Args &&...args) {
+	{
+		std::map<unsigned, int, std::less<unsigned>, Allocator<std::pair<unsigned const, int>>> map(args...);
+		times[0] = mapChurn(map);
+	}
+	{
+		std::list<unsigned, Allocator<unsigned>> list(args...);
+		times[1] = listChurn(list);
+	}
+	{
+		std::unordered_map<unsigned, int, std::hash<unsigned>, std::equal_to<unsigned>, Allocator<std::pair<unsigned const, int>>> map(args...);
+		times[2] = mapChurn(map);
+	}
+}
+
+int main() {
+	double times[ALLOCATOR_COUNT][CHURN_COUNT] = {{0.0}};
+	
+	churnbenchmark<std::allocator>(times[0]);
+	churnbenchmark<BuddyAllocator>(times[1]);
+	
+	BuddyResource resource;
+	churnbenchmark<std::pmr::polymorphic_allocator>(times[2], &resource);
+	
+	bheap_t *heap = bheap_create(HEAP_BUDGET);
+	if (heap == NULL) {
+		printf("Heap could not be created\n");
+		return 1;
+	}
+	BuddyHeapResource heapResource(heap);
+	churnbenchmark<std::pmr::polymorphic_allocator>(times[3], &heapResource);
+	bheap_destroy(heap);
+	
+	printf("Container churn (%d inserts, %d elements alive):\n", CHURN_ROUNDS, CHURN_KEYS);
+	printf("%-27s", "test");
+	for (int a = 0; a < ALLOCATOR_COUNT; ++a) printf(" || %10s", ALLOCATOR_NAMES[a]);
+	printf("\n");
+	for (int i = 0; i < CHURN_COUNT; ++i) {
+		printf("%-27s", CHURN_NAMES[i]);
+		for (int a = 0; a < ALLOCATOR_COUNT; ++a) printf(" || %8.0f%s", times[a][i], TIME_UNIT);
+		printf("\n");
+	}
+	return 0;
+}
@@ -0,0 +1,79 @@
+#include "buddy.hpp"
+#include "timing.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Benchmark of compile-time geometries against balloc
+//
+// buddy.c stays C, build it separately:
+// gcc -O2 -c buddy.c && g++ -O2 -std=c++17 buddy.o test_heap.cpp
+
+
+#define MICRO_COUNT			7
+#define MICRO_ROUNDS		20000
+#define MICRO_BATCH			64
+
+#define HEAP_COUNT			5
+
+static char const * const HEAP_NAMES[HEAP_COUNT] = {"default", "balloc", "heap 5/16", "heap 6/15", "heap 12/12"};
+
+/// Sizes used by the microbenchmark, one row each
+static size_t const MICRO_SIZES[MICRO_COUNT] = {8, 24, 120, 500, 2000, 16384, 65536};
+
+
+/// Measure per call cost of given allocate and free callables
+///
+/// Callables instead of function pointers, so the fast paths of a heap inline into the loop
+template <class Allocate, class Free>
+void microbenchmark(Allocate allocF, Free freeF, double *nanos) {
+	struct timespec start_time;
+	
+	void *batch[MICRO_BATCH];
+	
+	for (int i = 0; i < MICRO_COUNT; ++i) {
+		size_t size = MICRO_SIZES[i];
+		get_now(&start_time);
+		for (int round = 0; round < MICRO_ROUNDS; ++round) {
+			for (int j = 0; j < MICRO_BATCH; ++j) {
+				batch[j] = allocF(size);
+				*(long int *)batch[j] = (long int) batch[j];
+			}
+			for (int j = 0; j < MICRO_BATCH; ++j) {
+				assert(*(long int *)batch[j] == (long int) batch[j]);
+				freeF(batch[j], size);
+			}
+		}
+		// nanoseconds per single call
+		nanos[i] = get_nanos_since(&start_time) / ((double) MICRO_ROUNDS * MICRO_BATCH * 2);
+	}
+}
+
+/// Run the microbenchmark on a heap of given geometry
+template <class Heap>
+void heapbenchmark(double *nanos) {
+	Heap heap;
+	microbenchmark([&heap](size_t size) { return heap.allocate(size); }, [&heap](void *memory, size_t size) { heap.deallocate(memory, size); }, nanos);
+}
+
+int main() {
+	double nanos[HEAP_COUNT][MICRO_COUNT] = {{0.0}};
+	
+	microbenchmark([](size_t size) { return malloc(size); }, [](void *memory, size_t) { free(memory); }, nanos[0]);
+	microbenchmark([](size_t size) { return balloc(size); }, [](void *memory, size_t size) { bfree_sized(memory, size); }, nanos[1]);
+	heapbenchmark<DefaultBuddyHeap>(nanos[2]);
+	heapbenchmark<BuddyHeap<6, 15>>(nanos[3]);
+	heapbenchmark<BuddyHeap<12, 12>>(nanos[4]);
+	
+	printf("Per call cost (%d rounds of %d allocations and sized frees):\n", MICRO_ROUNDS, MICRO_BATCH);
+	printf("size       ");
+	for (int h = 0; h < HEAP_COUNT; ++h) printf(" || %10s", HEAP_NAMES[h]);
+	printf("\n");
+	for (int i = 0; i < MICRO_COUNT; ++i) {
+		printf("%-10zu ", MICRO_SIZES[i]);
+		for (int h = 0; h < HEAP_COUNT; ++h) printf(" || %8.2fns", nanos[h][i]);
+		printf("\n");
+	}
+	return 0;
+}
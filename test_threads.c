@@ -0,0 +1,120 @@
+#include "bench.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+// Cross thread free benchmark
+//
+// Needs buddy.c built with a thread safe model, for example:
+// gcc -O2 -pthread -DTHREAD_SAFE=2 buddy.c test_threads.c
+
+
+#define TU_PER_SEC			1000000
+#define NANOS_PER_TU		(GIGA / TU_PER_SEC)
+
+#define DEFAULT_PAIRS		2
+#define OPERATIONS			1000000		// objects passed from each producer to its consumer
+#define RING_SIZE			1024		// has to be a power of 2
+
+#define ENABLE_DEFAULT	1
+#define ENABLE_BUDDY	1
+
+static char const * const TIME_UNIT = "us";
+
+static size_t const SIZES[] = {16, 48, 100, 400, 24, 1000, 64, 8};
+#define SIZE_COUNT			(sizeof(SIZES) / sizeof(SIZES[0]))
+
+
+/// Single producer single consumer queue of objects
+///
+/// The producer allocates every object, the consumer frees it on another thread
+typedef struct Ring {
+	_Alignas(64) atomic_size_t	head;
+	_Alignas(64) atomic_size_t	tail;
+	void						*slots[RING_SIZE];
+	void						*(*allocF)(size_t);
+	void						(*freeF)(void *);
+} Ring;
+
+void *produce(void *arg) {
+	Ring *ring = (Ring*)arg;
+	for (size_t i = 0; i < OPERATIONS; ++i) {
+		long int *object = (long int*) ring->allocF(SIZES[i % SIZE_COUNT]);
+		assert(object != NULL);
+		*object = (long int) i;
+		
+		size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == RING_SIZE) sched_yield();
+		ring->slots[head % RING_SIZE] = object;
+		atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	}
+	return NULL;
+}
+
+void *consume(void *arg) {
+	Ring *ring = (Ring*)arg;
+	for (size_t i = 0; i < OPERATIONS; ++i) {
+		size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		while (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) sched_yield();
+		long int *object = (long int*) ring->slots[tail % RING_SIZE];
+		atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+		
+		assert(*object == (long int) i);
+		ring->freeF(object);
+	}
+	return NULL;
+}
+
+/// Run given number of producer consumer pairs using given allocator and deallocator
+///
+/// Returns the time it took in TIME_UNIT
+double benchmark(void *(*allocF)(size_t), void (*freeF)(void *), int pairs) {
+	Ring *rings = (Ring*) aligned_alloc(64, sizeof(Ring) * pairs);
+	pthread_t *threads = (pthread_t*) calloc(pairs * 2, sizeof(pthread_t));
+	
+	struct timespec start_time;
+	get_now(&start_time);
+	for (int i = 0; i < pairs; ++i) {
+		atomic_init(&rings[i].head, 0);
+		atomic_init(&rings[i].tail, 0);
+		rings[i].allocF = allocF;
+		rings[i].freeF = freeF;
+		pthread_create(&threads[2 * i], NULL, &produce, &rings[i]);
+		pthread_create(&threads[2 * i + 1], NULL, &consume, &rings[i]);
+	}
+	for (int i = 0; i < pairs * 2; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	double time = get_nanos_since(&start_time) / NANOS_PER_TU;
+	
+	free(threads);
+	free(rings);
+	return time;
+}
+
+int main(int argc, char **argv) {
+	int pairs = argc > 1 ? atoi(argv[1]) : DEFAULT_PAIRS;
+	if (pairs <= 0) pairs = DEFAULT_PAIRS;
+	
+	double default_time = 0.0;
+	double buddy_time = 0.0;
+
+#if ENABLE_DEFAULT
+	default_time = benchmark(&malloc, &free, pairs);
+#endif // ENABLE_DEFAULT
+
+#if ENABLE_BUDDY
+	buddy_time = benchmark(&balloc, &bfree, pairs);
+#endif // ENABLE_BUDDY
+
+	double operations = (double) OPERATIONS * pairs;
+	printf("Cross thread frees (%d producer/consumer pairs, %d objects each):\n", pairs, OPERATIONS);
+	printf("                            ||    default     ||     buddy\n");
+	printf("total time                  || %12.2f%s || %12.2f%s\n", default_time, TIME_UNIT, buddy_time, TIME_UNIT);
+	printf("objects per second          || %14.0f || %14.0f\n",
+		default_time > 0.0 ? operations * TU_PER_SEC / default_time : 0.0,
+		buddy_time > 0.0 ? operations * TU_PER_SEC / buddy_time : 0.0);
+	return 0;
+}
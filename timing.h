@@ -0,0 +1,17 @@
+#include <time.h>
+
+// Timing of the benchmarks and of the tests that measure, in C and in C++
+
+
+#define GIGA				1000000000	// 10^9 (or inverse of nano)
+#define TIME_USED_CLOCK		CLOCK_MONOTONIC
+
+
+#define get_now(time)	clock_gettime(TIME_USED_CLOCK, time)
+
+/// Nanoseconds passed since given time, seconds and nanoseconds subtracted apart so a second boundary borrows
+static inline double get_nanos_since(struct timespec *time) {
+	struct timespec now;
+	get_now(&now);
+	return (double)(now.tv_sec - time->tv_sec) * GIGA + (double)(now.tv_nsec - time->tv_nsec);
+}
@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+#include "bench.h"
+
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+// Random access benchmark over many objects
+//
+// Allocates objects of a single size until they add up to the given memory, links them into a single cycle
+// in random order and chases it, so nearly every access lands on another page and the time goes to TLB misses.
+// Huge pages of buddy.c are compile-time, so a build per mode, labelled to tell the results apart:
+// gcc -O2 buddy.c tlb.c -o tlb && ./tlb -l small
+// gcc -O2 -DHUGE_PAGES=1 buddy.c tlb.c -o tlb && ./tlb -l huge
+//
+// dTLB misses are read from a hardware counter where the kernel allows it (perf_event_paranoid up to 2),
+// huge pages from AnonHugePages of /proc/self/smaps_rollup.
+//
+// Options:
+// -m MB		memory requested in objects (default 512)
+// -s size		size of every object (default 48, a 64 byte block with its head)
+// -n count	accesses per run (default 10000000)
+// -r runs		measured runs, after one to warm up (default 5)
+// -a names	comma separated allocators to compare (default all)
+// -l label	label of this build, written to every row
+// -f csv		print CSV instead of a table
+
+
+#define DEFAULT_MEGABYTES	512
+#define DEFAULT_SIZE		48
+#define DEFAULT_ACCESSES	10000000
+#define DEFAULT_RUNS		5
+#define MAX_RUNS			101
+
+
+typedef struct Result {
+	double	allocate;		// nanoseconds per allocation, the first touch of the memory included
+	double	min;			// nanoseconds per access
+	double	median;
+	double	misses;			// dTLB load misses per access in the median run, negative if not counted
+	size_t	hugeBytes;		// memory backed by huge pages once everything is allocated
+} Result;
+
+/// Open a counter of dTLB load misses of the calling thread, -1 if the kernel doesn't allow it
+static int openMissCounter() {
+	struct perf_event_attr attributes;
+	memset(&attributes, 0, sizeof(attributes));
+	attributes.size = sizeof(attributes);
+	attributes.type = PERF_TYPE_HW_CACHE;
+	attributes.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attributes.disabled = 1;
+	attributes.exclude_kernel = 1;
+	attributes.exclude_hv = 1;
+	return (int) syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+}
+
+/// Anonymous memory of the process backed by huge pages, in bytes
+static size_t readHugeBytes() {
+	char line[256];
+	size_t kilobytes = 0;
+	FILE *file = fopen("/proc/self/smaps_rollup", "r");
+	if (file == NULL) return 0;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (strncmp(line, "AnonHugePages:", 14) == 0) {
+			kilobytes = strtoull(line + 14, NULL, 10);
+			break;
+		}
+	}
+	fclose(file);
+	return kilobytes * 1024;
+}
+
+static inline uint64_t nextRandom(uint64_t *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+/// Follow the cycle for given number of accesses, returns where it stopped, so the chase is not optimized out
+static void *chase(void *object, size_t accesses) {
+	for (size_t i = 0; i < accesses; ++i) object = *(void **)object;
+	return object;
+}
+
+static Result measure(Allocator const *allocator, size_t count, size_t size, size_t accesses, int runs) {
+	Result result = {0.0, 0.0, 0.0, -1.0, 0};
+	struct timespec start_time;
+	double samples[MAX_RUNS];
+	double misses[MAX_RUNS];
+	
+	void **objects = malloc(count * sizeof(void*));
+	if (objects == NULL) {
+		fprintf(stderr, "not enough memory for %zu objects\n", count);
+		exit(1);
+	}
+	get_now(&start_time);
+	for (size_t i = 0; i < count; ++i) {
+		objects[i] = allocator->allocate(size);
+		if (objects[i] == NULL) {
+			fprintf(stderr, "%s: out of memory after %zu objects\n", allocator->name, i);
+			exit(1);
+		}
+		memset(objects[i], 0, size);
+	}
+	result.allocate = get_nanos_since(&start_time) / count;
+	result.hugeBytes = readHugeBytes();
+	
+	// Link the objects in a random order, the cycle goes through all of them
+	uint64_t state = 0x9E3779B97F4A7C15ULL;
+	for (size_t i = count - 1; i > 0; --i) {
+		size_t j = nextRandom(&state) % (i + 1);
+		void *swapped = objects[i];
+		objects[i] = objects[j];
+		objects[j] = swapped;
+	}
+	for (size_t i = 0; i < count; ++i) *(void **)objects[i] = objects[(i + 1) % count];
+	
+	int counter = openMissCounter();
+	void *volatile end = chase(objects[0], accesses);
+	for (int run = 0; run < runs; ++run) {
+		uint64_t counted = 0;
+		if (counter >= 0) {
+			ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+			ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+		}
+		get_now(&start_time);
+		end = chase(end, accesses);
+		samples[run] = get_nanos_since(&start_time) / accesses;
+		if (counter >= 0) {
+			ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(counter, &counted, sizeof(counted)) != sizeof(counted)) counted = 0;
+		}
+		misses[run] = counter >= 0 ? (double) counted / accesses : -1.0;
+	}
+	if (counter >= 0) close(counter);
+	
+	// The run of the median time reports its misses
+	double sorted[MAX_RUNS];
+	memcpy(sorted, samples, runs * sizeof(double));
+	qsort(sorted, runs, sizeof(double), &compareDoubles);
+	result.min = sorted[0];
+	result.median = sorted[runs / 2];
+	for (int run = 0; run < runs; ++run) {
+		if (samples[run] == result.median) result.misses = misses[run];
+	}
+	
+	for (size_t i = 0; i < count; ++i) allocator->free(objects[i]);
+	free(objects);
+	return result;
+}
+
+static void printResult(char const *label, char const *name, Result const *result, int csv) {
+	if (csv) {
+		printf("%s,%s,%.2f,%.2f,%.2f,%.4f,%zu\n", label, name, result->allocate, result->min, result->median, result->misses, result->hugeBytes);
+		return;
+	}
+	char misses[32] = "-";
+	if (result->misses >= 0) snprintf(misses, sizeof(misses), "%.3f", result->misses);
+	printf("%-12s || %8.2fns || %8.2fns || %8.2fns || %10s || %10zuMB\n", name, result->allocate, result->min, result->median, misses, result->hugeBytes >> 20);
+}
+
+static void usage(char const *program) {
+	fprintf(stderr, "usage: %s [-m MB] [-s size] [-n accesses] [-r runs] [-a allocators] [-l label] [-f csv]\n", program);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	size_t megabytes = DEFAULT_MEGABYTES;
+	size_t size = DEFAULT_SIZE;
+	size_t accesses = DEFAULT_ACCESSES;
+	int runs = DEFAULT_RUNS;
+	char const *names = NULL;
+	char const *label = "";
+	int csv = 0;
+	
+	int option;
+	while ((option = getopt(argc, argv, "m:s:n:r:a:l:f:")) != -1) {
+		switch (option) {
+			case 'm': megabytes = strtoull(optarg, NULL, 10); break;
+			case 's': size = strtoull(optarg, NULL, 10); break;
+			case 'n': accesses = strtoull(optarg, NULL, 10); break;
+			case 'r': runs = atoi(optarg); break;
+			case 'a': names = optarg; break;
+			case 'l': label = optarg; break;
+			case 'f': csv = strcmp(optarg, "csv") == 0; if (!csv) usage(argv[0]); break;
+			default: usage(argv[0]);
+		}
+	}
+	// Every object holds the pointer to the next one
+	if (optind != argc || size < sizeof(void*) || accesses == 0 || runs < 1 || runs > MAX_RUNS) usage(argv[0]);
+	size_t count = (megabytes << 20) / size;
+	if (count < 2) usage(argv[0]);
+	
+	if (csv) {
+		printf("label,allocator,allocate_ns,min_ns,median_ns,dtlb_misses,huge_bytes\n");
+	} else {
+		printf("%zu objects of %zu bytes, %zu accesses per run, %d runs, %s\n", count, size, accesses, runs, label);
+		printf("%-12s || %10s || %10s || %10s || %10s || %12s\n", "allocator", "allocate", "min", "median", "dTLB miss", "huge pages");
+	}
+	fflush(stdout);
+	
+	// Every allocator runs in a process of its own, so it starts from clean memory
+	for (size_t a = 0; a < ALLOCATOR_COUNT; ++a) {
+		if (!isSelected(names, ALLOCATORS[a].name)) continue;
+		pid_t child = fork();
+		if (child < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (child == 0) {
+			Result result = measure(&ALLOCATORS[a], count, size, accesses, runs);
+			printResult(label, ALLOCATORS[a].name, &result, csv);
+			fflush(stdout);
+			_exit(0);
+		}
+		int status;
+		waitpid(child, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) fprintf(stderr, "%s: benchmark failed\n", ALLOCATORS[a].name);
+	}
+	return 0;
+}